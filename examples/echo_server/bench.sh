@@ -0,0 +1,75 @@
+#!/bin/sh
+# Echo server benchmark: runs the server in each mode and drives it with
+# examples/loadgen over loopback, for every combination of connection
+# count, message size and number of cores given to the server. Prints
+# one line of key=value per run, the loadgen figures prefixed by the
+# server settings.
+#
+# Settings, from the environment:
+#   MODES        server modes                     "fork prefork threads event"
+#   CONNECTIONS  connection counts                "16 128 1024"
+#   SIZES        message sizes in bytes           "64 1024 16384"
+#   CORES        cores given to the server        "1 2 4"
+#   RATE         requests per second sent         "50000"
+#   DURATION     seconds per run                  "10"
+#   THREADS      loadgen threads                  "2"
+#   PORT         server port                      "8300"
+#
+# The server runs on the first cores, loadgen on the next ones when the
+# host has enough of them. Build the libraries, this example and
+# examples/loadgen first.
+
+MODES=${MODES:-"fork prefork threads event"}
+CONNECTIONS=${CONNECTIONS:-"16 128 1024"}
+SIZES=${SIZES:-"64 1024 16384"}
+CORES=${CORES:-"1 2 4"}
+RATE=${RATE:-50000}
+DURATION=${DURATION:-10}
+THREADS=${THREADS:-2}
+PORT=${PORT:-8300}
+
+cd "$(dirname "$0")"
+SERVER=./echo
+LOADGEN=../loadgen/loadgen
+CPUS=$(nproc)
+
+if [ ! -x "$SERVER" ] || [ ! -x "$LOADGEN" ]; then
+    echo "build examples/echo_server and examples/loadgen first" >&2
+    exit 1
+fi
+
+for cores in $CORES; do
+    if [ "$cores" -gt "$CPUS" ]; then
+        continue
+    fi
+    serverCpus="0-$((cores - 1))"
+    loadCpus="0-$((CPUS - 1))"
+    if [ "$CPUS" -gt "$cores" ]; then
+        loadCpus="$cores-$((CPUS - 1))"
+    fi
+
+    for mode in $MODES; do
+        for connections in $CONNECTIONS; do
+            # a pre-forked process or a thread serves one connection at a
+            # time, the event loop runs one process per core
+            workers=$cores
+            if [ "$mode" = "prefork" ] || [ "$mode" = "threads" ]; then
+                workers=$connections
+            fi
+
+            taskset -c "$serverCpus" $SERVER -m "$mode" -w "$workers" -p "$PORT" -q 4096 &
+            server=$!
+            sleep 1
+
+            for size in $SIZES; do
+                printf "server_mode=%s cores=%s workers=%s size=%s " \
+                       "$mode" "$cores" "$workers" "$size"
+                taskset -c "$loadCpus" $LOADGEN -p "$PORT" -c "$connections" -t "$THREADS" \
+                        -r "$RATE" -d "$DURATION" -s "$size"
+            done
+
+            kill -TERM "$server"
+            wait "$server" 2>/dev/null
+        done
+    done
+done
@@ -1,5 +1,7 @@
-/*  Simple implmentation that just display a message when a new connection
-    is received.
+/*  Echo server used to benchmark the server modes of libnpmnetwork. Every
+    byte received is sent back until the client closes the connection.
+    The mode is chosen with -m fork|prefork|threads|event and the number
+    of worker processes or threads with -w.
 
     MIT License
 
@@ -23,6 +25,7 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
     SOFTWARE. */
 #include <stdlib.h>
+#include <stdio.h>
 #include <unistd.h>
 #include <ctype.h>
 #include <errno.h>
@@ -32,26 +35,113 @@
 #include "../../libnpmtoolkit/dist/include/logger.h"
 #include "../../libnpmnetwork/dist/include/server.h"
 
+/* bytes read per call */
+#define ECHO_BUFFER_SIZE 65536
+
+/* what a client did not take yet in event mode, kept until it can */
+struct echopending
+  {
+    size_t length;
+    size_t sent;
+    char data[ECHO_BUFFER_SIZE];
+  };
+
 /* building the params from the command line */
 void set_options(int argc, char* argv[], struct serverparams *params, int *logenabled);
 void validate_options(struct serverparams *params);
 
-/* Request handler function */
-void my_function(int i)
+/* Request handler of the fork, pre-fork and thread modes, send back
+   everything received until the client closes */
+void echo_connection(int client)
 {
-    logmsg(LOGGER_INFO, "New connection handled, client socket: %d", i);
+    char buffer[ECHO_BUFFER_SIZE];
+    ssize_t read = 0;
+
+    while ((read = recv(client, buffer, sizeof(buffer), 0)) > 0)
+    {
+        if (send_to_client(client, buffer, read) < 0)
+        {
+            break;
+        }
+    }
+}
+
+/* Request handler of the event mode, send back what is available without
+   blocking, close on end of stream. When the client does not read as fast
+   as it sends, the rest is kept and nothing more is read until it is sent,
+   so one slow reader does not hold the loop */
+int echo_event(int client, struct connection* conn)
+{
+    char buffer[ECHO_BUFFER_SIZE];
+    struct echopending* pending = (struct echopending*)conn->state;
+    ssize_t read = 0;
+    ssize_t sent = 0;
+
+    if (pending != NULL)
+    {
+        while (pending->sent < pending->length)
+        {
+            sent = send(client, pending->data + pending->sent, pending->length - pending->sent,
+                        MSG_DONTWAIT | MSG_NOSIGNAL);
+            if (sent < 0)
+            {
+                return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+            }
+            pending->sent += sent;
+        }
+
+        connection_release_state(conn);
+        if (poll_for_output(client, 0) < 0)
+        {
+            return -1;
+        }
+    }
+
+    while ((read = recv(client, buffer, sizeof(buffer), 0)) > 0)
+    {
+        if ((sent = send(client, buffer, read, MSG_DONTWAIT | MSG_NOSIGNAL)) < 0)
+        {
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                return -1;
+            }
+            sent = 0;
+        }
+
+        if (sent < read)
+        {
+            pending = (struct echopending*)connection_state(conn, sizeof(struct echopending));
+            if (pending == NULL)
+            {
+                return -1;
+            }
+            pending->length = read - sent;
+            pending->sent = 0;
+            memcpy(pending->data, buffer + sent, pending->length);
+            return poll_for_output(client, 1);
+        }
+    }
+
+    if (read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        return -1;
+    }
+    return 0;
 }
 
 /* main program */
 int main(int argc, char* argv[])
 { 
     int logenabled = 0;
-    struct serverparams params = { 8080,        // default port
-                                   AF_INET,     // using IPv4 or  IPv6
-                                   SOCK_STREAM, // TCP
-                                   0,           // non-blocking 
-                                   100,         // 100 request max 
-                                   &my_function // handler
+    struct serverparams params = { 8080,             // default port
+                                   AF_INET,          // using IPv4 or  IPv6
+                                   SOCK_STREAM,      // TCP
+                                   0,                // non-blocking 
+                                   1024,             // pending connections max 
+                                   &echo_connection, // handler
+                                   SERVER_MODE_EVENT,
+                                   &echo_event,      // handler of the event mode
+                                   0                 // workers, one per CPU
                                  };
     
     // can override the default options with command line
@@ -72,7 +162,7 @@ int main(int argc, char* argv[])
 void set_options(int argc, char* argv[], struct serverparams *params, int *logenabled)
 {
     int c;
-    while ((c = getopt(argc, argv, "p:q:d")) != -1)
+    while ((c = getopt(argc, argv, "p:q:m:w:d")) != -1)
     {
         switch (c)
         {
@@ -82,6 +172,15 @@ void set_options(int argc, char* argv[], struct serverparams *params, int *logen
           case 'q':
             params->queue = atoi(optarg);
             break;
+          case 'm':
+            params->mode = strcmp(optarg, "fork") == 0 ? SERVER_MODE_FORK
+                         : strcmp(optarg, "prefork") == 0 ? SERVER_MODE_PREFORK
+                         : strcmp(optarg, "threads") == 0 ? SERVER_MODE_THREADS
+                         : strcmp(optarg, "event") == 0 ? SERVER_MODE_EVENT : -1;
+            break;
+          case 'w':
+            params->workers = atoi(optarg);
+            break;
           case 'd':
             *logenabled = 1;
             break;
@@ -104,4 +203,16 @@ void validate_options(struct serverparams *params)
         logmsg(LOGGER_FATAL, "Request queue size too small: %d", params->queue);
         exit(-2);
     }
+
+    if (params->mode < 0)
+    {
+        logmsg(LOGGER_FATAL, "Unknown mode, use fork, prefork, threads or event");
+        exit(-3);
+    }
+
+    if (params->workers < 0)
+    {
+        logmsg(LOGGER_FATAL, "Invalid number of workers: %d", params->workers);
+        exit(-4);
+    }
 }
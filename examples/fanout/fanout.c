@@ -0,0 +1,194 @@
+/*  Fetch a list of URLs concurrently with the fetch engine and report the
+    timings of each request, then the throughput of the whole run. The
+    URLs are read from the standard input, one per line, in the form
+    http://host[:port]/path
+
+    Output, one line per request:
+    url status bytes reused connect_us firstbyte_us total_us
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include "../../libnpmnetwork/dist/include/fetch.h"
+#include "../../libnpmnetwork/dist/include/trace.h"
+
+/* building the params from the command line */
+void set_options(int argc, char* argv[], struct fetchparams* params);
+int parse_url(char* url, struct fetchrequest* request);
+
+long g_bytes = 0;
+int g_failed = 0;
+
+/* print the timings of a completed request */
+void print_request(struct fetchrequest* request, const byte* response, size_t length)
+{
+    struct fetchtimings* t = &request->timings;
+
+    if (request->error != 0)
+    {
+        g_failed++;
+        printf("%s error %d\n", (char*)request->context, request->error);
+        return;
+    }
+
+    g_bytes += length;
+    printf("%s %d %zu %d %lu %lu %lu\n", (char*)request->context, request->status, length,
+           request->reused,
+           t->connected > t->queued ? (unsigned long)(t->connected - t->queued) / 1000 : 0UL,
+           (unsigned long)(t->firstbyte - t->sent) / 1000,
+           (unsigned long)(t->completed - t->queued) / 1000);
+}
+
+/* main program */
+int main(int argc, char* argv[])
+{
+    struct fetchparams params = { 256, 8, 16, 10000, &print_request };
+    struct fetchrequest* requests = NULL;
+    struct fetchengine* engine = NULL;
+    char line[2048];
+    int count = 0, capacity = 1024, completed = 0, i;
+    u_int64_t start, elapsed;
+
+    set_options(argc, argv, &params);
+
+    requests = (struct fetchrequest*)calloc(capacity, sizeof(struct fetchrequest));
+    while (fgets(line, sizeof(line), stdin) != NULL)
+    {
+        line[strcspn(line, "\r\n")] = '\0';
+        if (line[0] == '\0')
+        {
+            continue;
+        }
+        if (count == capacity)
+        {
+            capacity *= 2;
+            requests = (struct fetchrequest*)realloc(requests, capacity * sizeof(struct fetchrequest));
+            memset(requests + count, 0, (capacity - count) * sizeof(struct fetchrequest));
+        }
+        requests[count].context = strdup(line);
+        if (parse_url(line, &requests[count]) < 0)
+        {
+            fprintf(stderr, "Invalid URL: %s\n", (char*)requests[count].context);
+            free(requests[count].context);
+            continue;
+        }
+        count++;
+    }
+
+    if ((engine = create_fetch_engine(&params)) == NULL)
+    {
+        fprintf(stderr, "Cannot create the fetch engine\n");
+        exit(-1);
+    }
+
+    start = trace_clock();
+    for (i = 0; i < count; i++)
+    {
+        queue_fetch(engine, &requests[i]);
+    }
+    completed = run_fetch_engine(engine);
+    elapsed = trace_clock() - start;
+
+    fprintf(stderr, "requests=%d completed=%d failed=%d bytes=%ld seconds=%.3f "
+            "requests_per_second=%.0f\n", count, completed, g_failed, g_bytes,
+            elapsed / 1e9, elapsed > 0 ? completed * 1e9 / elapsed : 0.0);
+
+    destroy_fetch_engine(engine);
+    for (i = 0; i < count; i++)
+    {
+        free(requests[i].hostname);
+        free(requests[i].context);
+    }
+    free(requests);
+    return 0;
+}
+
+/* split URL in place, the strings of REQUEST point into one copy */
+int parse_url(char* url, struct fetchrequest* request)
+{
+    char* host = NULL;
+    char* path = NULL;
+    char* port = NULL;
+    size_t length = 0;
+
+    if (strncmp(url, "http://", 7) != 0)
+    {
+        return -1;
+    }
+
+    // hostname\0port\0/path\0 in a single allocation
+    host = url + 7;
+    length = strcspn(host, "/");
+    if (length == 0 || (request->hostname = (char*)malloc(strlen(host) + 16)) == NULL)
+    {
+        return -1;
+    }
+    memcpy(request->hostname, host, length);
+    request->hostname[length] = '\0';
+
+    if ((port = strchr(request->hostname, ':')) != NULL)
+    {
+        *port++ = '\0';
+        request->port = port;
+        path = port + strlen(port) + 1;
+    }
+    else
+    {
+        request->port = request->hostname + length + 1;
+        strcpy(request->port, "80");
+        path = request->port + 3;
+    }
+
+    strcpy(path, host[length] == '/' ? host + length : "/");
+    request->path = path;
+    return 0;
+}
+
+void set_options(int argc, char* argv[], struct fetchparams* params)
+{
+    int c;
+    while ((c = getopt(argc, argv, "c:h:d:t:")) != -1)
+    {
+        switch (c)
+        {
+          case 'c':
+            params->maxconnections = atoi(optarg);
+            break;
+          case 'h':
+            params->maxperhost = atoi(optarg);
+            break;
+          case 'd':
+            params->pipelinedepth = atoi(optarg);
+            break;
+          case 't':
+            params->timeout = atoi(optarg);
+            break;
+          default:
+            fprintf(stderr, "usage: fanout [-c connections] [-h per host] "
+                    "[-d pipeline depth] [-t timeout ms] < urls\n");
+            exit(-1);
+        }
+    }
+}
@@ -24,63 +24,63 @@
     SOFTWARE. */
 #include <stdlib.h>
 #include <stdio.h>
-#include <unistd.h>
-#include <errno.h>
-#include <sys/un.h>
-#include <sys/types.h>
 #include <sys/socket.h>
-#include <netdb.h>
-#include <netinet/in.h>
-#include "../../libnpmnetwork/dist/include/client.h"
+#include "../../libnpmnetwork/dist/include/http.h"
 
 int main(int argc, char* argv[])
-{   
-    // reference to the client socket
-    int socket = 0;
+{
+    struct httpclient* client = NULL;
+    struct httpresponse response;
+    struct recvbuffer buffer;
+    struct clientparams params;
+    struct httprequest request = { "GET", "/", NULL, NULL, 0 };
+    int status = 0;
+    int i;
+
+    if (argc < 3)
+    {
+        printf("usage: hc host port [path]\n");
+        exit(-1);
+    }
 
     // setup the client params for connection
-    struct addrinfo *hostinfo;
-    struct clientparams params;
-    params.hostname =  argv[1];
+    params.hostname = argv[1];
     params.port = argv[2];
     params.family = AF_UNSPEC;
     params.type = SOCK_STREAM;
-    
-    // get the host information via the network layer of the OS
-    if (prepare_connection(&params, &hostinfo) < 0)
+    if (argc > 3)
+    {
+        request.path = argv[3];
+    }
+
+    if ((client = create_http_client(1, 30)) == NULL)
     {
-        printf("Could not get host information: %d\n", errno);
+        printf("Could not create the client\n");
         exit(-1);
     }
-    
-    // actually connecting to the host, after this operation,
-    // read/write possible.
-    if ((socket = connect_to_host(hostinfo)) < 0)
+
+    // the response is received and parsed in the buffer
+    init_receive_buffer(&buffer, NULL, 0, 0);
+    if ((status = http_request(client, &params, &request, &buffer, &response)) < 0)
     {
-        printf("Could not connect to host: %d\n", errno);
+        printf("Could not get a response from the host: %d\n", status);
+        destroy_http_client(client);
         exit(-2);
-    } 
-    
-    // sending a http request
-    byte* request = "GET / HTTP/1.1\r\n\r\n";
-    size_t requestsize = 22;
-    send_data_to_host(socket, request, requestsize);
-    
-    // reading the response and close the client socket
-    byte* content = NULL;
-    size_t read = waiting_data_from_host(socket, &content, 0);
-    close(socket);
-    
-    if (read > 0)
+    }
+
+    printf("HTTP/1.%d %d %.*s\n", response.minor, response.status, 
+           (int)response.reasonlength, response.reason);
+    for (i = 0; i < response.headercount; i++)
     {
-        // got the raw byte, want to make a readable string
-        unsigned char* stringcontent = (unsigned char*)malloc(read + 1);
-        memcpy(stringcontent, content, read);
-        memset(stringcontent + read, 0, 1);
-        free(content);
-        
-        printf("%s", stringcontent);  
+        printf("%.*s: %.*s\n", (int)response.headers[i].namelength, response.headers[i].name,
+               (int)response.headers[i].valuelength, response.headers[i].value);
     }
-    
-    printf("Byte received: %d\n", read);
+    printf("\n");
+    fwrite(response.body, 1, response.bodylength, stdout);
+
+    printf("\nByte received: %zu\n", response.length);
+
+    free_receive_buffer(&buffer);
+    destroy_http_client(client);
+    return 0;
 }
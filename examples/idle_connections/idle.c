@@ -0,0 +1,277 @@
+/*  Benchmark that measures the memory used by the event server to hold a
+    large number of idle connections. A server is forked in event mode,
+    then the benchmark opens the connections on the loopback interface
+    and reports the resident memory of the server per connection.
+
+    Holding one million connections needs a file descriptor limit of a
+    bit more than one million in both processes (see fs.nr_open) and the
+    local port range is reused across several loopback addresses.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <unistd.h>
+#include <errno.h>
+#include <signal.h>
+#include <string.h>
+#include <dirent.h>
+#include <sys/wait.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include "../../libnpmnetwork/dist/include/server.h"
+
+/* connections opened per loopback address, below the local port range */
+#define CONNECTIONS_PER_ADDRESS 25000
+
+/* building the params from the command line */
+void set_options(int argc, char* argv[], long *count, int *port);
+long read_rss_kb(pid_t pid);
+long count_open_files(pid_t pid);
+long kernel_tcp_pages(void);
+
+/* Request handler, drop anything received and close on end of stream.
+   No state is attached to the connection */
+int drop_data(int socket, struct connection* conn)
+{
+    char buffer[512];
+    ssize_t read = 0;
+
+    (void)conn;
+
+    while ((read = recv(socket, buffer, sizeof(buffer), 0)) > 0);
+    if (read == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        return -1;
+    }
+
+    return 0;
+}
+
+/* open one connection to the server through a loopback ADDRESS */
+int open_connection(int address, int port)
+{
+    struct sockaddr_in saddr;
+    int csocket = 0;
+
+    if ((csocket = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    {
+        return -1;
+    }
+
+    memset(&saddr, 0, sizeof(saddr));
+    saddr.sin_family = AF_INET;
+    saddr.sin_port = htons(port);
+    saddr.sin_addr.s_addr = htonl(INADDR_LOOPBACK + address);
+
+    if (connect(csocket, (struct sockaddr*)&saddr, sizeof(saddr)) < 0)
+    {
+        close(csocket);
+        return -1;
+    }
+
+    return csocket;
+}
+
+/* main program */
+int main(int argc, char* argv[])
+{
+    long count = 1000000;
+    int port = 9090;
+    long i, baseline, rss, tcpBefore, tcpAfter;
+    int *sockets = NULL;
+    pid_t server;
+    struct rlimit limit;
+    struct serverparams params = { 9090, AF_INET, SOCK_STREAM, 0, 4096, NULL,
+                                   SERVER_MODE_EVENT, &drop_data };
+
+    set_options(argc, argv, &count, &port);
+    params.port = port;
+
+    // both processes need one descriptor per connection
+    limit.rlim_cur = limit.rlim_max = count + 64;
+    if (setrlimit(RLIMIT_NOFILE, &limit) < 0)
+    {
+        getrlimit(RLIMIT_NOFILE, &limit);
+        fprintf(stderr, "Cannot raise the file limit, %ld connections max\n",
+                (long)limit.rlim_cur - 64);
+        exit(-1);
+    }
+
+    if ((server = fork()) == 0)
+    {
+        exit(create_new_server(&params));
+    }
+
+    // wait for the server to listen
+    for (i = 0; i < 100; i++)
+    {
+        int probe = open_connection(0, port);
+        if (probe >= 0)
+        {
+            close(probe);
+            break;
+        }
+        usleep(10000);
+    }
+
+    sleep(1);
+    baseline = read_rss_kb(server);
+    tcpBefore = kernel_tcp_pages();
+
+    if ((sockets = (int*)malloc(sizeof(int) * count)) == NULL)
+    {
+        fprintf(stderr, "Cannot allocate %ld sockets\n", count);
+        kill(server, SIGTERM);
+        waitpid(server, NULL, 0);
+        exit(-1);
+    }
+
+    for (i = 0; i < count; i++)
+    {
+        if ((sockets[i] = open_connection(i / CONNECTIONS_PER_ADDRESS, port)) < 0)
+        {
+            fprintf(stderr, "Cannot open connection %ld: %d\n", i, errno);
+            count = i;
+            break;
+        }
+    }
+
+    // let the server accept everything still in the queue
+    for (i = 0; i < 600 && count_open_files(server) < count; i++)
+    {
+        usleep(100000);
+    }
+
+    rss = read_rss_kb(server);
+    tcpAfter = kernel_tcp_pages();
+
+    printf("connections=%ld rss_baseline_kb=%ld rss_kb=%ld "
+           "rss_bytes_per_connection=%.1f kernel_tcp_bytes_per_connection=%.1f\n",
+           count, baseline, rss,
+           count > 0 ? (rss - baseline) * 1024.0 / count : 0.0,
+           count > 0 ? (tcpAfter - tcpBefore) * (double)getpagesize() / count : 0.0);
+
+    for (i = 0; i < count; i++)
+    {
+        close(sockets[i]);
+    }
+    free(sockets);
+
+    kill(server, SIGTERM);
+    waitpid(server, NULL, 0);
+    return 0;
+}
+
+long read_rss_kb(pid_t pid)
+{
+    char path[64];
+    char line[256];
+    long rss = -1;
+    FILE* status = NULL;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", pid);
+    if ((status = fopen(path, "r")) == NULL)
+    {
+        return -1;
+    }
+
+    while (fgets(line, sizeof(line), status) != NULL)
+    {
+        if (sscanf(line, "VmRSS: %ld kB", &rss) == 1)
+        {
+            break;
+        }
+    }
+
+    fclose(status);
+    return rss;
+}
+
+long count_open_files(pid_t pid)
+{
+    char path[64];
+    long files = 0;
+    DIR* dir = NULL;
+
+    snprintf(path, sizeof(path), "/proc/%d/fd", pid);
+    if ((dir = opendir(path)) == NULL)
+    {
+        return -1;
+    }
+
+    while (readdir(dir) != NULL)
+    {
+        files++;
+    }
+
+    closedir(dir);
+
+    // ".", "..", stdin, stdout, stderr, server socket and epoll
+    return files - 7;
+}
+
+long kernel_tcp_pages(void)
+{
+    char line[256];
+    long pages = 0;
+    FILE* sockstat = NULL;
+
+    if ((sockstat = fopen("/proc/net/sockstat", "r")) == NULL)
+    {
+        return 0;
+    }
+
+    while (fgets(line, sizeof(line), sockstat) != NULL)
+    {
+        char* mem = NULL;
+        if (strncmp(line, "TCP:", 4) == 0 && (mem = strstr(line, "mem ")) != NULL)
+        {
+            pages = atol(mem + 4);
+        }
+    }
+
+    fclose(sockstat);
+    return pages;
+}
+
+void set_options(int argc, char* argv[], long *count, int *port)
+{
+    int c;
+    while ((c = getopt(argc, argv, "n:p:")) != -1)
+    {
+        switch (c)
+        {
+          case 'n':
+            *count = atol(optarg);
+            break;
+          case 'p':
+            *port = atoi(optarg);
+            break;
+          default:
+            abort();
+        }
+    }
+}
@@ -0,0 +1,502 @@
+/*  Open-loop load generator for the servers built on libnpmnetwork. Each
+    connection sends its requests on a fixed schedule, whatever the time
+    the previous responses took, and the latency of a request is measured
+    from the time it was scheduled. A slow response delays the requests
+    behind it, that delay is counted in their latency instead of being
+    hidden (coordinated omission). The latencies go to HDR histograms
+    with 3 significant digits.
+
+    Output, one line of key=value:
+    mode connections threads rate duration_s requests errors timeouts
+    throughput_rps p50_us p99_us p999_us max_us mean_us
+    uncorrected_p99_us uncorrected_max_us
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "../../libnpmnetwork/dist/include/client.h"
+#include "../../libnpmnetwork/dist/include/dnscache.h"
+#include "../../libnpmnetwork/dist/include/trace.h"
+
+/* HDR histogram of nanoseconds, 3 significant digits up to an hour */
+#define HDR_SUB_BUCKET_MAGNITUDE  11
+#define HDR_SUB_BUCKET_COUNT      (1 << HDR_SUB_BUCKET_MAGNITUDE)
+#define HDR_SUB_BUCKET_HALF       (HDR_SUB_BUCKET_COUNT / 2)
+#define HDR_BUCKET_COUNT          32
+#define HDR_COUNTS                ((HDR_BUCKET_COUNT + 1) * HDR_SUB_BUCKET_HALF)
+#define HDR_MAX_VALUE             3600000000000ULL
+
+/* time given to the responses in flight at the end of the run, ns */
+#define DRAIN_TIME 2000000000ULL
+
+#define MODE_ECHO 0
+#define MODE_HTTP 1
+
+struct histogram
+  {
+    u_int64_t counts[HDR_COUNTS];
+    u_int64_t total;
+    u_int64_t max;
+    double sum;
+  };
+
+/* one connection and its schedule */
+struct loadconn
+  {
+    int socket;
+    int busy;               // a request is in flight
+    u_int64_t interval;     // between two requests, ns
+    u_int64_t intended;     // scheduled time of the next or current request
+    u_int64_t sent;         // time the current request was actually sent
+    size_t expected;        // echo bytes still to receive
+    struct recvbuffer buffer;
+  };
+
+struct loadthread
+  {
+    pthread_t thread;
+    struct loadconn* conns;
+    int count;
+    struct histogram corrected;
+    struct histogram uncorrected;
+    u_int64_t requests;
+    u_int64_t errors;
+    u_int64_t timeouts;
+  };
+
+/* parameters of the run */
+char* g_host = "127.0.0.1";
+char* g_port = "8080";
+char* g_path = "/";
+int g_mode = MODE_ECHO;
+int g_connections = 64;
+int g_threads = 2;
+double g_rate = 10000;
+int g_duration = 10;
+size_t g_size = 64;
+byte* g_request = NULL;
+size_t g_requestLength = 0;
+u_int64_t g_start = 0;
+u_int64_t g_end = 0;
+
+void set_options(int argc, char* argv[]);
+
+static int hdr_index(u_int64_t value)
+{
+    int bucket = 64 - __builtin_clzll(value | (HDR_SUB_BUCKET_COUNT - 1)) 
+                 - HDR_SUB_BUCKET_MAGNITUDE;
+    int sub = (int)(value >> bucket);
+
+    return (bucket << (HDR_SUB_BUCKET_MAGNITUDE - 1)) + sub;
+}
+
+/* highest value counted at INDEX */
+static u_int64_t hdr_value(int index)
+{
+    int bucket = (index >> (HDR_SUB_BUCKET_MAGNITUDE - 1)) - 1;
+    u_int64_t sub = (index & (HDR_SUB_BUCKET_HALF - 1)) + HDR_SUB_BUCKET_HALF;
+
+    if (bucket < 0)
+    {
+        sub -= HDR_SUB_BUCKET_HALF;
+        bucket = 0;
+    }
+
+    return (sub << bucket) + ((1ULL << bucket) - 1);
+}
+
+void hdr_record(struct histogram* h, u_int64_t value)
+{
+    if (value > HDR_MAX_VALUE)
+    {
+        value = HDR_MAX_VALUE;
+    }
+
+    h->counts[hdr_index(value)]++;
+    h->total++;
+    h->sum += value;
+    if (value > h->max)
+    {
+        h->max = value;
+    }
+}
+
+void hdr_add(struct histogram* to, struct histogram* from)
+{
+    int i;
+
+    for (i = 0; i < HDR_COUNTS; i++)
+    {
+        to->counts[i] += from->counts[i];
+    }
+    to->total += from->total;
+    to->sum += from->sum;
+    if (from->max > to->max)
+    {
+        to->max = from->max;
+    }
+}
+
+u_int64_t hdr_percentile(struct histogram* h, double percentile)
+{
+    u_int64_t target = (u_int64_t)(h->total * percentile / 100.0 + 0.5);
+    u_int64_t seen = 0;
+    int i;
+
+    if (target == 0)
+    {
+        target = 1;
+    }
+
+    for (i = 0; i < HDR_COUNTS; i++)
+    {
+        seen += h->counts[i];
+        if (seen >= target)
+        {
+            return hdr_value(i) < h->max ? hdr_value(i) : h->max;
+        }
+    }
+
+    return h->max;
+}
+
+/* open a connection to the server */
+int open_load_connection(struct addrinfo* hostinfo)
+{
+    int socket = 0;
+    int one = 1;
+
+    if ((socket = connect_to_host(hostinfo)) < 0)
+    {
+        return -1;
+    }
+
+    setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return socket;
+}
+
+/* tell if the response in flight on CONN is complete */
+int response_complete(struct loadconn* conn)
+{
+    ssize_t length = 0;
+
+    if (g_mode == MODE_ECHO)
+    {
+        return conn->buffer.length >= g_size;
+    }
+
+    if ((length = http_message_length(conn->buffer.data, conn->buffer.length)) > 0)
+    {
+        consume_receive_buffer(&conn->buffer, length);
+        return 1;
+    }
+
+    return length < 0 ? -1 : 0;
+}
+
+void* run_load(void* arg)
+{
+    struct loadthread* self = (struct loadthread*)arg;
+    struct epoll_event events[256];
+    struct epoll_event event;
+    struct loadconn* conn = NULL;
+    u_int64_t now, next, completed;
+    struct timespec timeout;
+    ssize_t received = 0;
+    int epoll, count, i, done, busy;
+
+    epoll = epoll_create1(0);
+    for (i = 0; i < self->count; i++)
+    {
+        event.events = EPOLLIN;
+        event.data.ptr = &self->conns[i];
+        epoll_ctl(epoll, EPOLL_CTL_ADD, self->conns[i].socket, &event);
+    }
+
+    while (1)
+    {
+        // send the requests due, the late ones keep their scheduled time
+        now = trace_clock();
+        next = now < g_end ? g_end : now + 1000000;
+        busy = 0;
+        for (i = 0; i < self->count; i++)
+        {
+            conn = &self->conns[i];
+            if (conn->socket < 0 || conn->busy)
+            {
+                busy += conn->socket >= 0;
+                continue;
+            }
+            if (now >= g_end)
+            {
+                continue;
+            }
+            if (conn->intended <= now)
+            {
+                if (send(conn->socket, g_request, g_requestLength, MSG_NOSIGNAL) 
+                    != (ssize_t)g_requestLength)
+                {
+                    self->errors++;
+                    close(conn->socket);
+                    conn->socket = -1;
+                    continue;
+                }
+                conn->sent = trace_clock();
+                conn->busy = 1;
+                busy++;
+                conn->buffer.length = 0;
+            }
+            else if (conn->intended < next)
+            {
+                next = conn->intended;
+            }
+        }
+
+        // after the end, only the responses in flight are waited for
+        if (now >= g_end && (busy == 0 || now >= g_end + DRAIN_TIME))
+        {
+            break;
+        }
+
+        // a timeout in nanoseconds, epoll_wait would round to the millisecond
+        timeout.tv_sec = next > now ? (next - now) / 1000000000ULL : 0;
+        timeout.tv_nsec = next > now ? (next - now) % 1000000000ULL : 0;
+        count = epoll_pwait2(epoll, events, 256, &timeout, NULL);
+        for (i = 0; i < count; i++)
+        {
+            conn = (struct loadconn*)events[i].data.ptr;
+
+            // nothing read and no error is a wake up without data, the
+            // end of stream leaves errno untouched
+            errno = 0;
+            received = receive_into_buffer(conn->socket, &conn->buffer, MSG_DONTWAIT);
+            if (received == 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            {
+                continue;
+            }
+            if (received <= 0 || !conn->busy || (done = response_complete(conn)) < 0)
+            {
+                self->errors++;
+                epoll_ctl(epoll, EPOLL_CTL_DEL, conn->socket, NULL);
+                close(conn->socket);
+                conn->socket = -1;
+                continue;
+            }
+            if (!done)
+            {
+                continue;
+            }
+
+            completed = trace_clock();
+            hdr_record(&self->corrected, completed - conn->intended);
+            hdr_record(&self->uncorrected, completed - conn->sent);
+            self->requests++;
+            conn->busy = 0;
+            conn->intended += conn->interval;
+        }
+    }
+
+    // the requests never answered count with the time they waited
+    now = trace_clock();
+    for (i = 0; i < self->count; i++)
+    {
+        if (self->conns[i].socket >= 0 && self->conns[i].busy)
+        {
+            hdr_record(&self->corrected, now - self->conns[i].intended);
+            hdr_record(&self->uncorrected, now - self->conns[i].sent);
+            self->timeouts++;
+        }
+    }
+
+    close(epoll);
+    return NULL;
+}
+
+/* main program */
+int main(int argc, char* argv[])
+{
+    struct clientparams params;
+    struct addrinfo* hostinfo = NULL;
+    struct loadthread* threads = NULL;
+    struct loadconn* conns = NULL;
+    struct histogram* corrected = NULL;
+    struct histogram* uncorrected = NULL;
+    u_int64_t requests = 0, errors = 0, timeouts = 0, interval;
+    double elapsed;
+    int i, perThread;
+
+    set_options(argc, argv);
+
+    params.hostname = g_host;
+    params.port = g_port;
+    params.family = AF_UNSPEC;
+    params.type = SOCK_STREAM;
+    if (prepare_connection(&params, &hostinfo) < 0)
+    {
+        fprintf(stderr, "Cannot resolve %s\n", g_host);
+        exit(-1);
+    }
+
+    if (g_mode == MODE_ECHO)
+    {
+        g_requestLength = g_size;
+        g_request = (byte*)malloc(g_size);
+        memset(g_request, 'x', g_size);
+    }
+    else
+    {
+        g_requestLength = asprintf((char**)&g_request, "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n",
+                                   g_path, g_host);
+    }
+
+    // every connection runs at the same rate, started at even offsets
+    interval = (u_int64_t)(1e9 * g_connections / g_rate);
+    conns = (struct loadconn*)calloc(g_connections, sizeof(struct loadconn));
+    g_start = trace_clock() + 100000000ULL;
+    g_end = g_start + (u_int64_t)g_duration * 1000000000ULL;
+    for (i = 0; i < g_connections; i++)
+    {
+        if ((conns[i].socket = open_load_connection(hostinfo)) < 0)
+        {
+            fprintf(stderr, "Cannot connect to %s:%s\n", g_host, g_port);
+            exit(-2);
+        }
+        conns[i].interval = interval;
+        conns[i].intended = g_start + interval * i / g_connections;
+        init_receive_buffer(&conns[i].buffer, NULL, 0, 0);
+    }
+
+    threads = (struct loadthread*)calloc(g_threads, sizeof(struct loadthread));
+    perThread = (g_connections + g_threads - 1) / g_threads;
+    for (i = 0; i < g_threads; i++)
+    {
+        threads[i].conns = conns + i * perThread;
+        threads[i].count = i * perThread >= g_connections ? 0
+                           : (g_connections - i * perThread < perThread 
+                              ? g_connections - i * perThread : perThread);
+        pthread_create(&threads[i].thread, NULL, run_load, &threads[i]);
+    }
+
+    corrected = (struct histogram*)calloc(1, sizeof(struct histogram));
+    uncorrected = (struct histogram*)calloc(1, sizeof(struct histogram));
+    for (i = 0; i < g_threads; i++)
+    {
+        pthread_join(threads[i].thread, NULL);
+        hdr_add(corrected, &threads[i].corrected);
+        hdr_add(uncorrected, &threads[i].uncorrected);
+        requests += threads[i].requests;
+        errors += threads[i].errors;
+        timeouts += threads[i].timeouts;
+    }
+
+    elapsed = (trace_clock() - g_start) / 1e9;
+    printf("mode=%s connections=%d threads=%d rate=%.0f duration_s=%.3f requests=%lu "
+           "errors=%lu timeouts=%lu throughput_rps=%.1f p50_us=%.1f p99_us=%.1f p999_us=%.1f "
+           "max_us=%.1f mean_us=%.1f uncorrected_p99_us=%.1f uncorrected_max_us=%.1f\n",
+           g_mode == MODE_ECHO ? "echo" : "http", g_connections, g_threads, g_rate, elapsed,
+           (unsigned long)requests, (unsigned long)errors, (unsigned long)timeouts,
+           requests / elapsed,
+           hdr_percentile(corrected, 50.0) / 1e3, hdr_percentile(corrected, 99.0) / 1e3,
+           hdr_percentile(corrected, 99.9) / 1e3, corrected->max / 1e3,
+           corrected->total > 0 ? corrected->sum / corrected->total / 1e3 : 0.0,
+           hdr_percentile(uncorrected, 99.0) / 1e3, uncorrected->max / 1e3);
+
+    for (i = 0; i < g_connections; i++)
+    {
+        if (conns[i].socket >= 0)
+        {
+            close(conns[i].socket);
+        }
+        free_receive_buffer(&conns[i].buffer);
+    }
+    free(conns);
+    free(threads);
+    free(corrected);
+    free(uncorrected);
+    free(g_request);
+    free_addrinfo_copy(hostinfo);
+    return errors > 0 || timeouts > 0 ? 1 : 0;
+}
+
+void set_options(int argc, char* argv[])
+{
+    int c;
+    while ((c = getopt(argc, argv, "h:p:m:c:t:r:d:s:u:")) != -1)
+    {
+        switch (c)
+        {
+          case 'h':
+            g_host = optarg;
+            break;
+          case 'p':
+            g_port = optarg;
+            break;
+          case 'm':
+            g_mode = strcmp(optarg, "http") == 0 ? MODE_HTTP : MODE_ECHO;
+            break;
+          case 'c':
+            g_connections = atoi(optarg);
+            break;
+          case 't':
+            g_threads = atoi(optarg);
+            break;
+          case 'r':
+            g_rate = atof(optarg);
+            break;
+          case 'd':
+            g_duration = atoi(optarg);
+            break;
+          case 's':
+            g_size = (size_t)atol(optarg);
+            break;
+          case 'u':
+            g_path = optarg;
+            break;
+          default:
+            fprintf(stderr, "usage: loadgen [-h host] [-p port] [-m echo|http] "
+                    "[-c connections] [-t threads] [-r requests/s] [-d seconds] "
+                    "[-s echo bytes] [-u http path]\n");
+            exit(-1);
+        }
+    }
+
+    if (g_connections < 1 || g_threads < 1 || g_rate <= 0 || g_duration < 1 || g_size < 1)
+    {
+        fprintf(stderr, "Invalid options\n");
+        exit(-1);
+    }
+    if (g_threads > g_connections)
+    {
+        g_threads = g_connections;
+    }
+}
@@ -0,0 +1,435 @@
+/*  Decode a binary log written by the logger with enable_binary_logging
+    and print it as text, in the same layout as the text logger. The log
+    is read from the file given on the command line or from the standard
+    input, and must be decoded on a host with the same byte order and
+    type sizes as the one that wrote it.
+
+    usage: logdecode [file]
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <time.h>
+#include "../../libnpmtoolkit/dist/include/logger.h"
+
+/* buckets of the table of formats */
+#define FORMAT_BUCKETS 1024
+
+/* longest conversion specification rebuilt for printf */
+#define SPEC_SIZE 64
+
+/* format registered by one process */
+struct definition
+  {
+    uint32_t pid;
+    uint32_t id;
+    uint8_t argc;
+    uint8_t types[LOG_MAX_ARGS];
+    char* format;
+    struct definition* next;
+  };
+
+/* process forked from another one, it uses the formats of its parent */
+struct forked
+  {
+    uint32_t pid;
+    uint32_t parent;
+    struct forked* next;
+  };
+
+struct definition* g_definitions[FORMAT_BUCKETS];
+struct forked* g_forks = NULL;
+
+void add_definition(struct logrecord* header, const char* data, size_t length);
+void add_fork(uint32_t pid, uint32_t parent);
+struct definition* find_definition(uint32_t pid, uint32_t id);
+void print_prefix(struct logrecord* header);
+void print_message(struct definition* def, const char* data, size_t length);
+
+/* main program */
+int main(int argc, char* argv[])
+{
+    struct logrecord header;
+    struct definition* def = NULL;
+    FILE* in = stdin;
+    char* data = NULL;
+    size_t length = 0;
+    long records = 0;
+
+    if (argc > 2)
+    {
+        fprintf(stderr, "usage: logdecode [file]\n");
+        exit(-1);
+    }
+
+    if (argc == 2 && (in = fopen(argv[1], "rb")) == NULL)
+    {
+        perror(argv[1]);
+        exit(-1);
+    }
+
+    data = (char*)malloc(UINT16_MAX);
+    while (fread(&header, sizeof(header), 1, in) == 1)
+    {
+        if (header.length < sizeof(header))
+        {
+            fprintf(stderr, "Corrupted record at record %ld\n", records);
+            exit(-1);
+        }
+
+        length = header.length - sizeof(header);
+        if (fread(data, 1, length, in) != length)
+        {
+            fprintf(stderr, "Truncated record at record %ld\n", records);
+            exit(-1);
+        }
+
+        if (records == 0 && (header.type != LOG_RECORD_START || length < 8
+                             || memcmp(data, LOG_BINARY_MAGIC, 8) != 0))
+        {
+            fprintf(stderr, "Not a binary log\n");
+            exit(-1);
+        }
+        records++;
+
+        switch (header.type)
+        {
+          case LOG_RECORD_FORMAT:
+            add_definition(&header, data, length);
+            break;
+          case LOG_RECORD_FORK:
+            add_fork(header.pid, header.id);
+            break;
+          case LOG_RECORD_TEXT:
+            print_prefix(&header);
+            fwrite(data, 1, length, stdout);
+            putchar('\n');
+            break;
+          case LOG_RECORD_MESSAGE:
+            print_prefix(&header);
+            if ((def = find_definition(header.pid, header.id)) == NULL)
+            {
+                printf("<unknown format %u>\n", header.id);
+                break;
+            }
+            print_message(def, data, length);
+            putchar('\n');
+            break;
+        }
+    }
+
+    free(data);
+    if (in != stdin)
+    {
+        fclose(in);
+    }
+    return 0;
+}
+
+void add_definition(struct logrecord* header, const char* data, size_t length)
+{
+    struct definition* def = NULL;
+    uint32_t bucket = (header->pid ^ header->id) % FORMAT_BUCKETS;
+    uint8_t argc = (uint8_t)data[0];
+    uint8_t types[LOG_MAX_ARGS];
+
+    // the types must be the ones the logger finds in the format, so each
+    // conversion gets a value of its own type and %n is never printed
+    if (length < 2 || argc > LOG_MAX_ARGS || length < 1 + argc + 1u
+        || data[length - 1] != '\0'
+        || parse_log_format(data + 1 + argc, types) != argc
+        || memcmp(types, data + 1, argc) != 0)
+    {
+        fprintf(stderr, "Invalid format %u of process %u\n", header->id, header->pid);
+        return;
+    }
+
+    // a newer definition hides the one of a process with the same pid
+    def = (struct definition*)malloc(sizeof(struct definition));
+    def->pid = header->pid;
+    def->id = header->id;
+    def->argc = argc;
+    memcpy(def->types, data + 1, argc);
+    def->format = strdup(data + 1 + argc);
+    def->next = g_definitions[bucket];
+    g_definitions[bucket] = def;
+}
+
+void add_fork(uint32_t pid, uint32_t parent)
+{
+    struct forked* child = (struct forked*)malloc(sizeof(struct forked));
+
+    child->pid = pid;
+    child->parent = parent;
+    child->next = g_forks;
+    g_forks = child;
+}
+
+/* look for the format in the process, then in its parents */
+struct definition* find_definition(uint32_t pid, uint32_t id)
+{
+    struct definition* def = NULL;
+    struct forked* child = NULL;
+    int depth;
+
+    for (depth = 0; depth < 64; depth++)
+    {
+        for (def = g_definitions[(pid ^ id) % FORMAT_BUCKETS]; def != NULL; def = def->next)
+        {
+            if (def->pid == pid && def->id == id)
+            {
+                return def;
+            }
+        }
+
+        for (child = g_forks; child != NULL && child->pid != pid; child = child->next);
+        if (child == NULL)
+        {
+            return NULL;
+        }
+        pid = child->parent;
+    }
+
+    return NULL;
+}
+
+void print_prefix(struct logrecord* header)
+{
+    time_t seconds = (time_t)(header->timestamp / 1000000000);
+    struct tm tm_info;
+    char timestamp[32];
+
+    localtime_r(&seconds, &tm_info);
+    strftime(timestamp, sizeof(timestamp), "%Y-%m-%d %H:%M:%S", &tm_info);
+    printf("%s.%06lu [%d] [%u]: ", timestamp,
+           (unsigned long)(header->timestamp % 1000000000) / 1000, header->level, header->pid);
+}
+
+/* read one argument of size bytes, return 0 if the record is too short */
+int read_argument(void* value, size_t size, const char* data, size_t length, size_t* offset)
+{
+    if (*offset + size > length)
+    {
+        return 0;
+    }
+
+    memcpy(value, data + *offset, size);
+    *offset += size;
+    return 1;
+}
+
+/* append a number to the specification, for the stars of the format */
+size_t append_number(char* spec, size_t specLength, int value)
+{
+    return specLength + snprintf(spec + specLength, SPEC_SIZE - specLength, "%d", value);
+}
+
+/* format the message with the arguments of the record, one conversion
+   at a time so each value is passed to printf with its own type */
+void print_message(struct definition* def, const char* data, size_t length)
+{
+    const char* p = def->format;
+    size_t offset = 0;
+    int arg = 0;
+
+    while (*p != '\0')
+    {
+        char spec[SPEC_SIZE];
+        size_t specLength = 0;
+        int star = 0;
+
+        if (*p != '%')
+        {
+            putchar(*p++);
+            continue;
+        }
+
+        if (p[1] == '%')
+        {
+            putchar('%');
+            p += 2;
+            continue;
+        }
+
+        spec[specLength++] = *p++;
+        while (*p != '\0' && strchr("-+ #0'", *p) != NULL && specLength < SPEC_SIZE - 24)
+        {
+            spec[specLength++] = *p++;
+        }
+
+        // the width and precision taken from arguments are written in the spec
+        if (*p == '*')
+        {
+            if (arg >= def->argc || !read_argument(&star, sizeof(star), data, length, &offset))
+            {
+                goto truncated;
+            }
+            specLength = append_number(spec, specLength, star);
+            arg++;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9' && specLength < SPEC_SIZE - 24)
+        {
+            spec[specLength++] = *p++;
+        }
+
+        if (*p == '.')
+        {
+            p++;
+            if (*p == '*')
+            {
+                if (arg >= def->argc || !read_argument(&star, sizeof(star), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                if (star >= 0)
+                {
+                    spec[specLength++] = '.';
+                    specLength = append_number(spec, specLength, star);
+                }
+                arg++;
+                p++;
+            }
+            else
+            {
+                spec[specLength++] = '.';
+                while (*p >= '0' && *p <= '9' && specLength < SPEC_SIZE - 24)
+                {
+                    spec[specLength++] = *p++;
+                }
+            }
+        }
+
+        // the length is given by the type of the argument, except the
+        // truncation of short integers
+        while (*p != '\0' && strchr("hlqjztL", *p) != NULL)
+        {
+            if (*p == 'h')
+            {
+                spec[specLength++] = 'h';
+            }
+            p++;
+        }
+
+        // a width or precision too long for the spec leaves digits behind
+        if (*p == '\0' || arg >= def->argc || strchr("diouxXceEfFgGaAsp", *p) == NULL)
+        {
+            goto truncated;
+        }
+
+        switch (def->types[arg++])
+        {
+          case LOG_ARG_INT:
+            {
+                int value;
+                if (!read_argument(&value, sizeof(value), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, value);
+            }
+            break;
+          case LOG_ARG_LONG:
+            {
+                long long value;
+                if (!read_argument(&value, sizeof(value), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                specLength -= spec[specLength - 1] == 'h' ? (spec[specLength - 2] == 'h' ? 2 : 1) : 0;
+                spec[specLength++] = 'l';
+                spec[specLength++] = 'l';
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, value);
+            }
+            break;
+          case LOG_ARG_DOUBLE:
+            {
+                double value;
+                if (!read_argument(&value, sizeof(value), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, value);
+            }
+            break;
+          case LOG_ARG_LONG_DOUBLE:
+            {
+                long double value;
+                if (!read_argument(&value, sizeof(value), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                spec[specLength++] = 'L';
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, value);
+            }
+            break;
+          case LOG_ARG_POINTER:
+            {
+                uint64_t value;
+                if (!read_argument(&value, sizeof(value), data, length, &offset))
+                {
+                    goto truncated;
+                }
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, (void*)(uintptr_t)value);
+            }
+            break;
+          case LOG_ARG_STRING:
+            {
+                uint16_t count;
+                char* value = NULL;
+                if (!read_argument(&count, sizeof(count), data, length, &offset)
+                    || offset + count > length)
+                {
+                    goto truncated;
+                }
+                value = strndup(data + offset, count);
+                offset += count;
+                spec[specLength++] = *p;
+                spec[specLength] = '\0';
+                printf(spec, value);
+                free(value);
+            }
+            break;
+          default:
+            goto truncated;
+        }
+        p++;
+    }
+
+    return;
+
+truncated:
+    printf("<invalid arguments for \"%s\">", def->format);
+}
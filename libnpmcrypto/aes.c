@@ -516,3 +516,36 @@ int aes_cbc_decrypt(unsigned char *data, unsigned char *iv, unsigned int len, un
 
 	return CRYPTO_OK;
 }
+
+int aes_ctr_encrypt(unsigned char *data, unsigned char *counter, unsigned int len, unsigned char *out, aes_key *key)
+{
+	unsigned int i;
+	int j;
+	unsigned char keystream[16];
+
+	CONDITION_CHECK((counter != NULL), CRYPTO_INVALID_ARG);
+
+	for (i = 0; i < len; i++)
+	{
+		// a new block of key stream every 16 bytes
+		if (i % 16 == 0)
+		{
+			aes_block_encrypt(counter, keystream, key);
+
+			// increment the big endian counter
+			for (j = 15; j >= 0; j--)
+			{
+				if (++counter[j] != 0)
+				{
+					break;
+				}
+			}
+		}
+
+		out[i] = data[i] ^ keystream[i % 16];
+	}
+
+	ZEROMEM(keystream, 16);
+
+	return CRYPTO_OK;
+}
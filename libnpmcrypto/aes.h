@@ -56,4 +56,9 @@ extern int aes_cbc_encrypt(unsigned char *data, unsigned char *iv, unsigned int
 /* decrypt multiple block using the CBC mode. IV is mandatory */
 extern int aes_cbc_decrypt(unsigned char *data, unsigned char *iv, unsigned int len, unsigned char *out, aes_key *key);
 
+/* encrypt or decrypt multiple bytes using the CTR mode. The COUNTER is a
+   16 bytes block incremented for each block of key stream, it holds the
+   next value on return. Any length is allowed and OUT can be DATA */
+extern int aes_ctr_encrypt(unsigned char *data, unsigned char *counter, unsigned int len, unsigned char *out, aes_key *key);
+
 #endif /* SRC_AES_H_ */
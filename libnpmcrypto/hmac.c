@@ -0,0 +1,108 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ */
+
+/* HMAC as defined in RFC 2104, using SHA256 as the hash */
+
+#include "hmac.h"
+
+int hmac_sha256_init(hmac_state *hmac, const unsigned char *key, unsigned long keylen)
+{
+	unsigned char pad[HMAC_SHA256_BLOCK_SIZE];
+	int result = CRYPTO_OK;
+	int i;
+
+	CONDITION_CHECK((hmac != NULL && key != NULL), CRYPTO_INVALID_ARG);
+
+	/* keys longer than a block are hashed first */
+	ZEROMEM(hmac->key, HMAC_SHA256_BLOCK_SIZE);
+	if (keylen > HMAC_SHA256_BLOCK_SIZE)
+	{
+		if ((result = sha256_hash(key, keylen, hmac->key)) != CRYPTO_OK)
+		{
+			return result;
+		}
+	}
+	else
+	{
+		XMEMCPY(hmac->key, key, keylen);
+	}
+
+	/* inner hash starts with the key xor ipad */
+	for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+	{
+		pad[i] = hmac->key[i] ^ 0x36;
+	}
+
+	if ((result = sha256_init(&hmac->md)) == CRYPTO_OK)
+	{
+		result = sha256_process(&hmac->md, pad, HMAC_SHA256_BLOCK_SIZE);
+	}
+
+	ZEROMEM(pad, HMAC_SHA256_BLOCK_SIZE);
+	return result;
+}
+
+int hmac_sha256_process(hmac_state *hmac, const unsigned char *in, unsigned long inlen)
+{
+	CONDITION_CHECK((hmac != NULL), CRYPTO_INVALID_ARG);
+
+	return sha256_process(&hmac->md, in, inlen);
+}
+
+int hmac_sha256_done(hmac_state *hmac, unsigned char *out)
+{
+	unsigned char pad[HMAC_SHA256_BLOCK_SIZE];
+	unsigned char inner[SHA256_HASH_SIZE];
+	int result = CRYPTO_OK;
+	int i;
+
+	CONDITION_CHECK((hmac != NULL && out != NULL), CRYPTO_INVALID_ARG);
+
+	if ((result = sha256_done(&hmac->md, inner)) != CRYPTO_OK)
+	{
+		return result;
+	}
+
+	/* outer hash of the key xor opad and the inner hash */
+	for (i = 0; i < HMAC_SHA256_BLOCK_SIZE; i++)
+	{
+		pad[i] = hmac->key[i] ^ 0x5C;
+	}
+
+	if ((result = sha256_init(&hmac->md)) == CRYPTO_OK
+		&& (result = sha256_process(&hmac->md, pad, HMAC_SHA256_BLOCK_SIZE)) == CRYPTO_OK
+		&& (result = sha256_process(&hmac->md, inner, SHA256_HASH_SIZE)) == CRYPTO_OK)
+	{
+		result = sha256_done(&hmac->md, out);
+	}
+
+	ZEROMEM(pad, HMAC_SHA256_BLOCK_SIZE);
+	ZEROMEM(inner, SHA256_HASH_SIZE);
+	ZEROMEM(hmac->key, HMAC_SHA256_BLOCK_SIZE);
+	return result;
+}
+
+int hmac_sha256(const unsigned char *key, unsigned long keylen,
+				const unsigned char *in, unsigned long inlen, unsigned char *out)
+{
+	int result = CRYPTO_OK;
+	hmac_state hmac;
+
+	if ((result = hmac_sha256_init(&hmac, key, keylen)) != CRYPTO_OK)
+	{
+		return result;
+	}
+
+	if ((result = hmac_sha256_process(&hmac, in, inlen)) != CRYPTO_OK)
+	{
+		return result;
+	}
+
+	return hmac_sha256_done(&hmac, out);
+}
@@ -0,0 +1,34 @@
+/* LibTomCrypt, modular cryptographic library -- Tom St Denis
+ *
+ * LibTomCrypt is a library that provides various cryptographic
+ * algorithms in a highly modular and flexible manner.
+ *
+ * The library is free for all purposes without any express
+ * guarantee it works.
+ */
+
+#ifndef LIBNPMCRYPTO_HMAC_H_
+#define LIBNPMCRYPTO_HMAC_H_
+
+#include "crypto.h"
+#include "sha.h"
+
+/* block size of SHA256, the key is padded to this size */
+#define HMAC_SHA256_BLOCK_SIZE 64
+
+/* HMAC state, keeps the padded key for the outer hash */
+typedef struct {
+	hash_state md;
+	unsigned char key[HMAC_SHA256_BLOCK_SIZE];
+} hmac_state;
+
+/* HMAC-SHA256 functions */
+int hmac_sha256_init(hmac_state *hmac, const unsigned char *key, unsigned long keylen);
+int hmac_sha256_process(hmac_state *hmac, const unsigned char *in, unsigned long inlen);
+int hmac_sha256_done(hmac_state *hmac, unsigned char *out);
+
+/* Wrapper function, instead of making 3 calls, only one is necessary */
+int hmac_sha256(const unsigned char *key, unsigned long keylen,
+				const unsigned char *in, unsigned long inlen, unsigned char *out);
+
+#endif /* LIBNPMCRYPTO_HMAC_H_ */
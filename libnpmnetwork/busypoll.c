@@ -0,0 +1,170 @@
+/*  Implementation of the busy polling of sockets
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <errno.h>
+#include <string.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include "busypoll.h"
+#include "trace.h"
+#include "internlog.h"
+
+/* error code */
+const int ERR_CANNOT_SET_BUSY_POLL = -1;
+
+/* budget in nanoseconds, 0 when disabled */
+u_int64_t g_busyPollBudget = 0;
+
+/* statistics, updated with relaxed atomics */
+struct busypollstats g_busyPollStats;
+
+#define STAT_ADD(field, value) \
+    __atomic_fetch_add(&g_busyPollStats.field, (value), __ATOMIC_RELAXED)
+
+void set_busy_poll_budget(u_int32_t usecs)
+{
+    g_busyPollBudget = (u_int64_t)usecs * 1000ULL;
+}
+
+int enable_socket_busy_poll(int socket, int usecs)
+{
+    if (setsockopt(socket, SOL_SOCKET, SO_BUSY_POLL, &usecs, sizeof(usecs)) < 0)
+    {
+        print_error("Cannot set busy poll on socket [%d]: %d", socket, errno);
+        return ERR_CANNOT_SET_BUSY_POLL;
+    }
+
+    return 0;
+}
+
+ssize_t busy_recv(int socket, void* buffer, size_t length, int flags)
+{
+    struct pollfd pfd;
+    u_int64_t deadline = 0;
+    u_int64_t spins = 0;
+    ssize_t received = 0;
+
+    if (g_busyPollBudget == 0 || (flags & MSG_DONTWAIT))
+    {
+        return trace_recv(socket, buffer, length, flags);
+    }
+
+    // data already there, nothing to wait for
+    received = trace_recv(socket, buffer, length, flags | MSG_DONTWAIT);
+    if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+    {
+        return received;
+    }
+
+    STAT_ADD(waits, 1);
+    deadline = trace_clock() + g_busyPollBudget;
+    do
+    {
+        spins++;
+        received = trace_recv(socket, buffer, length, flags | MSG_DONTWAIT);
+        if (received >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+        {
+            STAT_ADD(spins, spins);
+            STAT_ADD(spinhits, 1);
+            return received;
+        }
+    }
+    while (trace_clock() < deadline);
+
+    STAT_ADD(spins, spins);
+    STAT_ADD(fallbacks, 1);
+
+    // the socket may be non-blocking, wait for the data before reading
+    pfd.fd = socket;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+    return trace_recv(socket, buffer, length, flags);
+}
+
+int busy_epoll_wait(int epoll, struct epoll_event* events, int maxevents, int timeout)
+{
+    u_int64_t start = 0;
+    u_int64_t deadline = 0;
+    u_int64_t spent = 0;
+    u_int64_t spins = 0;
+    int ready = 0;
+
+    if (g_busyPollBudget == 0 || timeout == 0)
+    {
+        return epoll_wait(epoll, events, maxevents, timeout);
+    }
+
+    if ((ready = epoll_wait(epoll, events, maxevents, 0)) != 0)
+    {
+        return ready;
+    }
+
+    // the spin counts in the timeout, it never lasts longer than it
+    STAT_ADD(waits, 1);
+    start = trace_clock();
+    deadline = start + g_busyPollBudget;
+    if (timeout > 0 && (u_int64_t)timeout * 1000000ULL < g_busyPollBudget)
+    {
+        deadline = start + (u_int64_t)timeout * 1000000ULL;
+    }
+    do
+    {
+        spins++;
+        if ((ready = epoll_wait(epoll, events, maxevents, 0)) != 0)
+        {
+            STAT_ADD(spins, spins);
+            STAT_ADD(spinhits, 1);
+            return ready;
+        }
+    }
+    while (trace_clock() < deadline);
+
+    STAT_ADD(spins, spins);
+    STAT_ADD(fallbacks, 1);
+
+    if (timeout > 0)
+    {
+        spent = (trace_clock() - start) / 1000000ULL;
+        if (spent >= (u_int64_t)timeout)
+        {
+            return 0;
+        }
+        timeout -= (int)spent;
+    }
+    return epoll_wait(epoll, events, maxevents, timeout);
+}
+
+void get_busy_poll_stats(struct busypollstats* stats)
+{
+    stats->waits = __atomic_load_n(&g_busyPollStats.waits, __ATOMIC_RELAXED);
+    stats->spinhits = __atomic_load_n(&g_busyPollStats.spinhits, __ATOMIC_RELAXED);
+    stats->fallbacks = __atomic_load_n(&g_busyPollStats.fallbacks, __ATOMIC_RELAXED);
+    stats->spins = __atomic_load_n(&g_busyPollStats.spins, __ATOMIC_RELAXED);
+}
+
+void reset_busy_poll_stats(void)
+{
+    memset(&g_busyPollStats, 0, sizeof(g_busyPollStats));
+}
@@ -0,0 +1,70 @@
+/*  Prototype for the busy polling of sockets
+
+    This prototype defines receive and wait functions that spin on the
+    socket for a configurable budget before falling back to a blocking
+    wait. It trades CPU time for latency on connections where every
+    microsecond counts. The statistics tell how often the spinning found
+    data, to tune the budget.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef BUSYPOLL_H_
+#define BUSYPOLL_H_
+
+#include <sys/types.h>
+#include <sys/epoll.h>
+
+/* statistics of the busy polling, for all the threads */
+struct busypollstats
+  {
+    u_int64_t waits;        // calls that had to wait for data
+    u_int64_t spinhits;     // waits satisfied while spinning
+    u_int64_t fallbacks;    // waits that exhausted the budget and blocked
+    u_int64_t spins;        // non-blocking attempts made while spinning
+  };
+
+/* Set the time spent spinning before blocking, in microseconds. 0, the
+   default, disables the busy polling */
+extern void set_busy_poll_budget(u_int32_t __usecs);
+
+/* Ask the kernel to busy poll the device queue of __socket for __usecs
+   microseconds on blocking reads (SO_BUSY_POLL). Return 0 on success,
+   otherwise negative int, errno will be set */
+extern int enable_socket_busy_poll(int __socket, int __usecs);
+
+/* Receive like recv(2), spinning for the budget before blocking. Calls
+   with MSG_DONTWAIT do not spin */
+extern ssize_t busy_recv(int __socket, void* __buffer, size_t __length, int __flags);
+
+/* Wait for events like epoll_wait(2), spinning for the budget before
+   blocking for what is left of __timeout milliseconds */
+extern int busy_epoll_wait(int __epoll, struct epoll_event* __events, 
+                           int __maxevents, int __timeout);
+
+/* Copy the statistics in __stats */
+extern void get_busy_poll_stats(struct busypollstats* __stats);
+
+/* Reset the statistics to 0 */
+extern void reset_busy_poll_stats(void);
+
+#endif
@@ -22,33 +22,60 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
     SOFTWARE. */
 
+#define _GNU_SOURCE
+#include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
 #include <string.h>
+#include <strings.h>
 #include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+#include <poll.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <arpa/inet.h>
 #include "client.h"
+#include "busypoll.h"
+#include "dnscache.h"
 
 /* error code */
 const int ERR_CANNOT_GET_ADDR_INFO          = -1;
 const int ERR_CANNOT_CREATE_SOCKET_TO_HOST  = -2;
 const int ERR_CANNOT_CONNECT_TO_HOST        = -3;
 const int ERR_CANNOT_SEND_TO_HOST           = -4;
+const int ERR_TOO_MANY_CONNECTIONS          = -5;
+const int ERR_CANNOT_RECEIVE_FROM_HOST      = -6;
+const int ERR_RECEIVE_BUFFER_FULL           = -7;
+const int ERR_CONNECTION_CLOSED             = -8;
+const int ERR_INVALID_MESSAGE               = -9;
 
-/* the reading buffer size in bytes */
-const u_int16_t READ_BUFFER_SIZE            = 1024;
+/* addresses raced by a connection, and the delay between two attempts
+   in milliseconds, as recommended by RFC 8305 */
+#define MAX_CONNECT_ATTEMPTS    16
+#define CONNECT_ATTEMPT_DELAY   250
+
+/* the first allocation of a receive buffer in bytes */
+const u_int16_t READ_BUFFER_SIZE            = 16384;
+
+/* socket on which the thread is sending a request, its first send was
+   reported and the next ones are not until the response arrives */
+__thread int t_requestSocket = -1;
+
+/* body size from which send_bulk_to_host pins the pages instead of
+   copying them, below it the page pinning costs more than the copy */
+size_t g_zerocopyThreshold = 32768;
 
 extern int prepare_connection(struct clientparams* params, struct addrinfo** hostinfo)
 {
-    struct addrinfo hints;
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = params->family;
-    hints.ai_socktype = params->type;
-    
-    if (getaddrinfo(params->hostname, params->port, &hints, hostinfo) < 0)
+    // the cache resolves directly when it is disabled
+    if (resolve_with_cache(params, hostinfo) != 0)
     {
         print_error("Error while getting address info");
         return ERR_CANNOT_GET_ADDR_INFO;
@@ -59,29 +86,199 @@ extern int prepare_connection(struct clientparams* params, struct addrinfo** hos
 
 extern int connect_to_host(struct addrinfo* hostinfo) 
 {
-    int remoteSocket = 0;
-    
-    if ((remoteSocket = socket(hostinfo->ai_family, 
-                               hostinfo->ai_socktype, 
-                               hostinfo->ai_protocol)) < 0)
+    return connect_to_host_timeout(hostinfo, 0);
+}
+
+/* order the addresses alternating the families, starting with the
+   family of the first one, as in RFC 8305 section 4 */
+static int interleave_addresses(struct addrinfo* hostinfo, struct addrinfo** ordered)
+{
+    struct addrinfo* first[MAX_CONNECT_ATTEMPTS];
+    struct addrinfo* other[MAX_CONNECT_ATTEMPTS];
+    struct addrinfo* entry = NULL;
+    int firstCount = 0, otherCount = 0, count = 0;
+    int i = 0, j = 0;
+
+    for (entry = hostinfo; entry != NULL; entry = entry->ai_next)
     {
-        print_error("Error creating a socket to host");
-        return ERR_CANNOT_CREATE_SOCKET_TO_HOST;
+        if (entry->ai_family == hostinfo->ai_family && firstCount < MAX_CONNECT_ATTEMPTS)
+        {
+            first[firstCount++] = entry;
+        }
+        else if (entry->ai_family != hostinfo->ai_family && otherCount < MAX_CONNECT_ATTEMPTS)
+        {
+            other[otherCount++] = entry;
+        }
     }
-    
-    if (connect(remoteSocket, hostinfo->ai_addr, hostinfo->ai_addrlen) < 0)
+
+    while ((i < firstCount || j < otherCount) && count < MAX_CONNECT_ATTEMPTS)
     {
-       print_error("Could not connect to host");
-       return ERR_CANNOT_CONNECT_TO_HOST;
+        if (i < firstCount)
+        {
+            ordered[count++] = first[i++];
+        }
+        if (j < otherCount && count < MAX_CONNECT_ATTEMPTS)
+        {
+            ordered[count++] = other[j++];
+        }
     }
-    
+
+    return count;
+}
+
+/* start a non-blocking connect to ADDRESS, return the socket or -1 */
+static int start_connect(struct addrinfo* address)
+{
+    int remoteSocket = socket(address->ai_family, address->ai_socktype | SOCK_NONBLOCK,
+                              address->ai_protocol);
+
+    if (remoteSocket < 0)
+    {
+        return -1;
+    }
+
+    if (connect(remoteSocket, address->ai_addr, address->ai_addrlen) < 0 
+        && errno != EINPROGRESS)
+    {
+        close(remoteSocket);
+        return -1;
+    }
+
     return remoteSocket;
 }
 
+int connect_to_host_timeout(struct addrinfo* hostinfo, int timeout)
+{
+    struct addrinfo* addresses[MAX_CONNECT_ATTEMPTS];
+    struct pollfd attempts[MAX_CONNECT_ATTEMPTS];
+    u_int64_t deadline = 0;
+    u_int64_t nextAttempt = 0;
+    u_int64_t now = 0;
+    int count = interleave_addresses(hostinfo, addresses);
+    int started = 0, pending = 0, winner = -1;
+    int wait, error, i;
+    socklen_t errorLen = sizeof(error);
+
+    now = trace_clock();
+    deadline = timeout > 0 ? now + (u_int64_t)timeout * 1000000ULL : 0;
+
+    while (winner < 0)
+    {
+        // start the next address when the delay expired or nothing is pending
+        if (started < count && (pending == 0 || now >= nextAttempt))
+        {
+            attempts[started].fd = start_connect(addresses[started]);
+            attempts[started].events = POLLOUT;
+            attempts[started].revents = 0;
+            pending += attempts[started].fd >= 0 ? 1 : 0;
+            started++;
+            nextAttempt = now + CONNECT_ATTEMPT_DELAY * 1000000ULL;
+            continue;
+        }
+
+        if (pending == 0)
+        {
+            break;
+        }
+
+        wait = -1;
+        if (started < count)
+        {
+            wait = (int)((nextAttempt - now) / 1000000ULL) + 1;
+        }
+        if (deadline > 0)
+        {
+            if (now >= deadline)
+            {
+                errno = ETIMEDOUT;
+                break;
+            }
+            if (wait < 0 || (u_int64_t)wait * 1000000ULL > deadline - now)
+            {
+                wait = (int)((deadline - now) / 1000000ULL) + 1;
+            }
+        }
+
+        if (poll(attempts, started, wait) < 0 && errno != EINTR)
+        {
+            break;
+        }
+
+        for (i = 0; i < started && winner < 0; i++)
+        {
+            if (attempts[i].fd < 0 || attempts[i].revents == 0)
+            {
+                continue;
+            }
+
+            error = 0;
+            getsockopt(attempts[i].fd, SOL_SOCKET, SO_ERROR, &error, &errorLen);
+            if (error == 0)
+            {
+                winner = i;
+                break;
+            }
+
+            // this address failed, the next one starts right away
+            close(attempts[i].fd);
+            attempts[i].fd = -1;
+            pending--;
+            nextAttempt = now;
+        }
+
+        now = trace_clock();
+    }
+
+    for (i = 0; i < started; i++)
+    {
+        if (i != winner && attempts[i].fd >= 0)
+        {
+            close(attempts[i].fd);
+        }
+    }
+
+    if (winner < 0)
+    {
+        print_error("Could not connect to host");
+        return ERR_CANNOT_CONNECT_TO_HOST;
+    }
+
+    // callers expect a blocking socket
+    fcntl(attempts[winner].fd, F_SETFL, fcntl(attempts[winner].fd, F_GETFL, 0) & ~O_NONBLOCK);
+    TRACE_EVENT(attempts[winner].fd, TRACE_CONNECT);
+    return attempts[winner].fd;
+}
+
+/* report the first send of a request on SOCKET, once until its response */
+static void trace_first_send(int socket)
+{
+    if (g_traceSink != NULL && t_requestSocket != socket)
+    {
+        t_requestSocket = socket;
+        g_traceSink(socket, TRACE_FIRST_SEND, trace_clock());
+    }
+}
+
+/* report the first byte of a response on SOCKET, the next send starts a
+   new request */
+static void trace_first_recv(int socket)
+{
+    if (g_traceSink != NULL)
+    {
+        t_requestSocket = -1;
+        g_traceSink(socket, TRACE_FIRST_RECV, trace_clock());
+        // the request has left once answered
+        trace_send_completions(socket);
+    }
+}
+
 int send_data_to_host(int socket, byte* content, size_t len)
 {
     int byteSent = 0;
     
+    // the previous sends had time to leave, report their timestamps
+    trace_send_completions(socket);
+    trace_first_send(socket);
     if ((byteSent = send(socket, content, len, 0)) < 0)
     {
         print_error("Cannot send data to host");
@@ -91,24 +288,918 @@ int send_data_to_host(int socket, byte* content, size_t len)
     return 0;
 }
 
+void set_zerocopy_threshold(size_t threshold)
+{
+    g_zerocopyThreshold = threshold;
+}
+
+/* wait until the kernel released the pages of SENT zerocopy sends. The
+   notifications arrive on the error queue, signaled by POLLERR */
+static void wait_zerocopy_completions(int socket, int sent, int* completed)
+{
+    struct pollfd pfd;
+
+    drain_error_queue(socket, completed);
+    while (*completed < sent)
+    {
+        pfd.fd = socket;
+        pfd.events = 0;
+        pfd.revents = 0;
+        if (poll(&pfd, 1, 1000) < 0 && errno != EINTR)
+        {
+            break;
+        }
+        if (pfd.revents & POLLHUP)
+        {
+            // the connection is gone, its pages were released with it
+            break;
+        }
+        drain_error_queue(socket, completed);
+    }
+}
+
+/* send all the bytes of IOV. With MSG_ZEROCOPY, SENT counts the calls
+   that will be notified on the error queue */
+static int send_vectors(int socket, struct iovec* iov, int count, int flags, 
+                        int* sent, int* completed)
+{
+    struct msghdr msg;
+    ssize_t written = 0;
+
+    while (count > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        if ((written = sendmsg(socket, &msg, flags | MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            if (errno == ENOBUFS && (flags & MSG_ZEROCOPY))
+            {
+                // too many pages pinned, let the kernel release some
+                if (*completed < *sent)
+                {
+                    wait_zerocopy_completions(socket, *completed + 1, completed);
+                }
+                else
+                {
+                    flags &= ~MSG_ZEROCOPY;
+                }
+                continue;
+            }
+            print_error("Cannot send data to host: %d", errno);
+            return ERR_CANNOT_SEND_TO_HOST;
+        }
+
+        if (flags & MSG_ZEROCOPY)
+        {
+            (*sent)++;
+        }
+
+        // skip what was written, the rest is sent by the next call
+        while (count > 0 && (size_t)written >= iov->iov_len)
+        {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0)
+        {
+            iov->iov_base = (byte*)iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+
+    return 0;
+}
+
+int send_bulk_to_host(int socket, byte* header, size_t headerLength, 
+                      byte* body, size_t bodyLength)
+{
+    struct iovec iov[2];
+    int one = 1;
+    int sent = 0;
+    int completed = 0;
+    int result = 0;
+
+    iov[0].iov_base = header;
+    iov[0].iov_len = headerLength;
+    iov[1].iov_base = body;
+    iov[1].iov_len = bodyLength;
+
+    trace_send_completions(socket);
+    trace_first_send(socket);
+
+    if (bodyLength < g_zerocopyThreshold
+        || setsockopt(socket, SOL_SOCKET, SO_ZEROCOPY, &one, sizeof(one)) < 0)
+    {
+        // a single call, the header and the body leave in the same segments
+        return send_vectors(socket, iov, 2, 0, &sent, &completed);
+    }
+
+    // the header is copied and held back until the body joins it
+    if (headerLength > 0 && (result = send_vectors(socket, iov, 1, MSG_MORE, &sent, &completed)) < 0)
+    {
+        return result;
+    }
+
+    result = send_vectors(socket, iov + 1, 1, MSG_ZEROCOPY, &sent, &completed);
+
+    // the pages of BODY belong to the kernel until notified
+    wait_zerocopy_completions(socket, sent, &completed);
+    return result;
+}
+
+void init_receive_buffer(struct recvbuffer* buffer, byte* data, size_t capacity, size_t maximum)
+{
+    buffer->data = data;
+    buffer->length = 0;
+    buffer->capacity = data != NULL ? capacity : 0;
+    buffer->maximum = maximum;
+    buffer->growable = data == NULL;
+}
+
+void free_receive_buffer(struct recvbuffer* buffer)
+{
+    if (buffer->growable)
+    {
+        free(buffer->data);
+    }
+
+    buffer->data = NULL;
+    buffer->length = 0;
+    buffer->capacity = 0;
+}
+
+/* make room for more data, doubling the capacity up to the maximum */
+static int grow_receive_buffer(struct recvbuffer* buffer)
+{
+    size_t capacity = buffer->capacity > 0 ? buffer->capacity * 2 : READ_BUFFER_SIZE;
+    byte* data = NULL;
+
+    if (buffer->maximum > 0 && capacity > buffer->maximum)
+    {
+        capacity = buffer->maximum;
+    }
+
+    if (buffer->growable == 0 || capacity <= buffer->capacity)
+    {
+        return ERR_RECEIVE_BUFFER_FULL;
+    }
+
+    // large blocks are moved by remapping their pages, not copied
+    if ((data = (byte*)realloc(buffer->data, capacity)) == NULL)
+    {
+        return ERR_RECEIVE_BUFFER_FULL;
+    }
+
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return 0;
+}
+
+ssize_t receive_into_buffer(int socket, struct recvbuffer* buffer, int flags)
+{
+    ssize_t byteRead = 0;
+    size_t start = buffer->length;
+
+    while (1)
+    {
+        if (buffer->length == buffer->capacity && grow_receive_buffer(buffer) < 0)
+        {
+            print_error("Receive buffer full at %zu bytes", buffer->length);
+            return ERR_RECEIVE_BUFFER_FULL;
+        }
+
+        // the kernel copies straight into the buffer
+        byteRead = busy_recv(socket, buffer->data + buffer->length, 
+                             buffer->capacity - buffer->length, flags);
+        if (byteRead <= 0)
+        {
+            break;
+        }
+
+        if (buffer->length == 0)
+        {
+            trace_first_recv(socket);
+        }
+        buffer->length += byteRead;
+    }
+
+    if (byteRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && buffer->length == start)
+    {
+        print_error("Cannot receive data from host: %d", errno);
+        return ERR_CANNOT_RECEIVE_FROM_HOST;
+    }
+
+    return buffer->length - start;
+}
+
 size_t waiting_data_from_host(int socket, byte** content, int block)
 {
-    byte buffer[READ_BUFFER_SIZE];
-    byte* temp = NULL;
-    size_t byteRead, totalByteRead;
-    
-    memset(&buffer, 0, READ_BUFFER_SIZE);
-    byteRead = 0;
-    totalByteRead = 0;
-    
-    while ((byteRead = recv(socket, buffer, READ_BUFFER_SIZE, block)) > 0)
+    struct recvbuffer buffer;
+
+    // start from the memory of the caller, if any, as before
+    init_receive_buffer(&buffer, NULL, 0, 0);
+    buffer.data = *content;
+
+    receive_into_buffer(socket, &buffer, block);
+    *content = buffer.data;
+    return buffer.length;
+}
+
+void consume_receive_buffer(struct recvbuffer* buffer, size_t count)
+{
+    if (count >= buffer->length)
     {
-        temp = realloc(*content, totalByteRead + byteRead);
-        memcpy(temp + totalByteRead, buffer, byteRead);
-        *content = temp;
-        totalByteRead += byteRead;
-        
+        buffer->length = 0;
+        return;
     }
-    
-    return totalByteRead;
+
+    // only the bytes of the next message, usually few, are moved
+    memmove(buffer->data, buffer->data + count, buffer->length - count);
+    buffer->length -= count;
+}
+
+/* length of the complete message at the start of DATA, 0 if incomplete */
+typedef ssize_t (*message_framer)(const byte* data, size_t length, void* context);
+
+/* receive until FRAMER finds a complete message in BUFFER, the data
+   already in the buffer is checked first */
+static ssize_t receive_message(int socket, struct recvbuffer* buffer, int flags,
+                               message_framer framer, void* context, size_t hint)
+{
+    ssize_t message = 0;
+    ssize_t byteRead = 0;
+
+    while ((message = framer(buffer->data, buffer->length, context)) == 0)
+    {
+        // room for the expected message in one go when its size is known
+        while (buffer->capacity < hint || buffer->length == buffer->capacity)
+        {
+            if (grow_receive_buffer(buffer) < 0)
+            {
+                print_error("Receive buffer full at %zu bytes", buffer->length);
+                return ERR_RECEIVE_BUFFER_FULL;
+            }
+        }
+
+        byteRead = busy_recv(socket, buffer->data + buffer->length,
+                             buffer->capacity - buffer->length, flags);
+        if (byteRead == 0)
+        {
+            return ERR_CONNECTION_CLOSED;
+        }
+
+        if (byteRead < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : ERR_CANNOT_RECEIVE_FROM_HOST;
+        }
+
+        if (buffer->length == 0)
+        {
+            trace_first_recv(socket);
+        }
+        buffer->length += byteRead;
+    }
+
+    return message;
+}
+
+/* framer for a fixed number of bytes */
+static ssize_t exact_framer(const byte* data, size_t length, void* context)
+{
+    size_t count = *(size_t*)context;
+
+    return length >= count ? (ssize_t)count : 0;
+}
+
+ssize_t receive_exact(int socket, struct recvbuffer* buffer, size_t count, int flags)
+{
+    return receive_message(socket, buffer, flags, exact_framer, &count, count);
+}
+
+/* a delimiter to look for */
+struct delimiter
+  {
+    const byte* sequence;
+    size_t length;
+  };
+
+/* framer for a message ending with a delimiter */
+static ssize_t delimiter_framer(const byte* data, size_t length, void* context)
+{
+    struct delimiter* delim = (struct delimiter*)context;
+    const byte* found = NULL;
+
+    if (length == 0 || (found = memmem(data, length, delim->sequence, delim->length)) == NULL)
+    {
+        return 0;
+    }
+
+    return (found - data) + delim->length;
+}
+
+ssize_t receive_until(int socket, struct recvbuffer* buffer, const byte* delim, 
+                      size_t length, int flags)
+{
+    struct delimiter context = { delim, length };
+
+    return receive_message(socket, buffer, flags, delimiter_framer, &context, 0);
+}
+
+/* find the value of header NAME between START and END, NULL if missing */
+static const char* find_http_header(const char* start, const char* end, const char* name,
+                                    size_t* length)
+{
+    size_t nameLen = strlen(name);
+    const char* line = start;
+    const char* next = NULL;
+
+    while (line < end && (next = memmem(line, end - line, "\r\n", 2)) != NULL)
+    {
+        if (next - line > (ssize_t)nameLen && line[nameLen] == ':'
+            && strncasecmp(line, name, nameLen) == 0)
+        {
+            line += nameLen + 1;
+            while (line < next && (*line == ' ' || *line == '\t'))
+            {
+                line++;
+            }
+            while (next > line && (next[-1] == ' ' || next[-1] == '\t'))
+            {
+                next--;
+            }
+            *length = next - line;
+            return line;
+        }
+        line = next + 2;
+    }
+
+    return NULL;
+}
+
+int is_chunked_encoding(const char* value, size_t length)
+{
+    while (length > 0 && (value[length - 1] == ' ' || value[length - 1] == '\t'))
+    {
+        length--;
+    }
+
+    // "gzip, chunked", the codings before it are applied to the body
+    if (length < 7 || strncasecmp(value + length - 7, "chunked", 7) != 0)
+    {
+        return 0;
+    }
+
+    return length == 7 || value[length - 8] == ',' || value[length - 8] == ' '
+           || value[length - 8] == '\t';
+}
+
+/* parse the Content-Length value of LENGTH bytes at VALUE, digits only.
+   Return the length of the body, otherwise negative int */
+static ssize_t parse_content_length(const char* value, size_t length)
+{
+    ssize_t body = 0;
+    size_t i;
+
+    if (length == 0)
+    {
+        return ERR_INVALID_MESSAGE;
+    }
+
+    for (i = 0; i < length; i++)
+    {
+        if (value[i] < '0' || value[i] > '9' || body > (SSIZE_MAX - (value[i] - '0')) / 10)
+        {
+            return ERR_INVALID_MESSAGE;
+        }
+        body = body * 10 + (value[i] - '0');
+    }
+
+    return body;
+}
+
+ssize_t parse_chunk_size(const byte* data, size_t length, size_t* size)
+{
+    const byte* lineEnd = memmem(data, length, "\r\n", 2);
+    const byte* cursor = data;
+    size_t value = 0;
+    int digit = 0;
+
+    if (lineEnd == NULL)
+    {
+        return 0;
+    }
+
+    for (; cursor < lineEnd; cursor++)
+    {
+        if (*cursor >= '0' && *cursor <= '9')
+        {
+            digit = *cursor - '0';
+        }
+        else if ((*cursor | 0x20) >= 'a' && (*cursor | 0x20) <= 'f')
+        {
+            digit = (*cursor | 0x20) - 'a' + 10;
+        }
+        else
+        {
+            break;
+        }
+
+        if (value > (SIZE_MAX >> 4))
+        {
+            return ERR_INVALID_MESSAGE;
+        }
+        value = (value << 4) | digit;
+    }
+
+    // no size, or anything but whitespace and extensions after it
+    if (cursor == data)
+    {
+        return ERR_INVALID_MESSAGE;
+    }
+    while (cursor < lineEnd && (*cursor == ' ' || *cursor == '\t'))
+    {
+        cursor++;
+    }
+    if (cursor < lineEnd && *cursor != ';')
+    {
+        return ERR_INVALID_MESSAGE;
+    }
+
+    *size = value;
+    return (lineEnd + 2) - data;
+}
+
+/* length of the chunked body at DATA, 0 if incomplete */
+static ssize_t chunked_body_length(const byte* data, size_t length)
+{
+    const byte* cursor = data;
+    const byte* end = data + length;
+    const byte* lineEnd = NULL;
+    ssize_t offset = 0;
+    size_t chunk = 0;
+
+    while ((offset = parse_chunk_size(cursor, end - cursor, &chunk)) > 0)
+    {
+        cursor += offset;
+
+        if (chunk == 0)
+        {
+            // trailers, ended by an empty line
+            while ((lineEnd = memmem(cursor, end - cursor, "\r\n", 2)) != NULL)
+            {
+                if (lineEnd == cursor)
+                {
+                    return (lineEnd + 2) - data;
+                }
+                cursor = lineEnd + 2;
+            }
+            return 0;
+        }
+
+        // compared without adding to CHUNK, which may be near SIZE_MAX
+        if ((size_t)(end - cursor) < 2 || chunk > (size_t)(end - cursor) - 2)
+        {
+            return 0;
+        }
+        if (cursor[chunk] != '\r' || cursor[chunk + 1] != '\n')
+        {
+            return ERR_INVALID_MESSAGE;
+        }
+        cursor += chunk + 2;
+    }
+
+    return offset;
+}
+
+ssize_t frame_http_message(const byte* data, size_t length, int* untilClose)
+{
+    const byte* headersEnd = NULL;
+    const char* value = NULL;
+    size_t valueLen = 0;
+    size_t headersLen = 0;
+    ssize_t body = 0;
+    int status = 0;
+
+    *untilClose = 0;
+    if (length == 0 || (headersEnd = memmem(data, length, "\r\n\r\n", 4)) == NULL)
+    {
+        return 0;
+    }
+    headersLen = (headersEnd + 4) - data;
+
+    if ((value = find_http_header((const char*)data, (const char*)headersEnd + 2, 
+                                  "Transfer-Encoding", &valueLen)) != NULL
+        && is_chunked_encoding(value, valueLen))
+    {
+        body = chunked_body_length(headersEnd + 4, length - headersLen);
+        return body <= 0 ? body : (ssize_t)headersLen + body;
+    }
+
+    if ((value = find_http_header((const char*)data, (const char*)headersEnd + 2, 
+                                  "Content-Length", &valueLen)) != NULL)
+    {
+        if ((body = parse_content_length(value, valueLen)) < 0)
+        {
+            return ERR_INVALID_MESSAGE;
+        }
+        return length - headersLen >= (size_t)body ? (ssize_t)(headersLen + body) : 0;
+    }
+
+    // a request without length has no body, so does some responses
+    if (length < 12 || memcmp(data, "HTTP/", 5) != 0)
+    {
+        return headersLen;
+    }
+
+    status = atoi((const char*)data + 9);
+    if ((status >= 100 && status < 200) || status == 204 || status == 304)
+    {
+        return headersLen;
+    }
+
+    *untilClose = 1;
+    return 0;
+}
+
+ssize_t http_message_length(const byte* data, size_t length)
+{
+    int untilClose = 0;
+
+    return frame_http_message(data, length, &untilClose);
+}
+
+/* framer for an HTTP message */
+static ssize_t http_framer(const byte* data, size_t length, void* context)
+{
+    return frame_http_message(data, length, (int*)context);
+}
+
+ssize_t receive_http_message(int socket, struct recvbuffer* buffer, int flags)
+{
+    int untilClose = 0;
+    ssize_t message = receive_message(socket, buffer, flags, http_framer, &untilClose, 0);
+
+    // no length given, the body is everything up to the end of stream
+    if (message == ERR_CONNECTION_CLOSED && untilClose)
+    {
+        return buffer->length;
+    }
+
+    return message;
+}
+
+ssize_t stream_data_from_host(int socket, byte* buffer, size_t size, int flags,
+                              receive_callback callback, void* context)
+{
+    byte local[READ_BUFFER_SIZE];
+    ssize_t byteRead = 0;
+    size_t total = 0;
+
+    if (buffer == NULL || size == 0)
+    {
+        buffer = local;
+        size = READ_BUFFER_SIZE;
+    }
+
+    while ((byteRead = busy_recv(socket, buffer, size, flags)) > 0)
+    {
+        if (total == 0)
+        {
+            trace_first_recv(socket);
+        }
+        total += byteRead;
+
+        if (callback(buffer, byteRead, context) != 0)
+        {
+            break;
+        }
+    }
+
+    if (byteRead < 0 && errno != EAGAIN && errno != EWOULDBLOCK && total == 0)
+    {
+        print_error("Cannot receive data from host: %d", errno);
+        return ERR_CANNOT_RECEIVE_FROM_HOST;
+    }
+
+    return total;
+}
+
+/* idle connection waiting in the pool */
+struct idleconnection
+  {
+    int socket;
+    time_t since;
+  };
+
+/* connections of the pool to one host */
+struct poolhost
+  {
+    char* key;
+    int active;                     // connections in use
+    int* inuse;                     // their sockets, -1 while connecting
+    int idle;                       // connections in the idle stack
+    struct idleconnection* stack;   // most recently used on top
+    struct poolhost* next;
+  };
+
+struct connpool
+  {
+    int maxPerHost;
+    int idleTimeout;
+    int stopped;
+    struct poolhost* hosts;
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    pthread_t evictor;
+  };
+
+/* body of the background thread evicting the idle connections */
+static void* run_evictor(void* arg)
+{
+    struct connpool* pool = (struct connpool*)arg;
+    struct timespec deadline;
+
+    pthread_mutex_lock(&pool->lock);
+    while (pool->stopped == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += pool->idleTimeout > 1 ? pool->idleTimeout / 2 : 1;
+        pthread_cond_timedwait(&pool->wakeup, &pool->lock, &deadline);
+
+        if (pool->stopped == 0)
+        {
+            pthread_mutex_unlock(&pool->lock);
+            evict_idle_connections(pool);
+            pthread_mutex_lock(&pool->lock);
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return NULL;
+}
+
+struct connpool* create_connection_pool(int maxPerHost, int idleTimeout)
+{
+    struct connpool* pool = NULL;
+
+    if (maxPerHost < 1 || idleTimeout < 1)
+    {
+        return NULL;
+    }
+
+    if ((pool = (struct connpool*)calloc(1, sizeof(struct connpool))) == NULL)
+    {
+        return NULL;
+    }
+
+    pool->maxPerHost = maxPerHost;
+    pool->idleTimeout = idleTimeout;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+
+    if (pthread_create(&pool->evictor, NULL, run_evictor, pool) != 0)
+    {
+        print_error("Cannot start the connection pool evictor");
+        pthread_mutex_destroy(&pool->lock);
+        pthread_cond_destroy(&pool->wakeup);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/* find the host of PARAMS, adding it if missing. Called with the lock */
+static struct poolhost* find_pool_host(struct connpool* pool, struct clientparams* params)
+{
+    struct poolhost* host = NULL;
+    size_t hostLen = strlen(params->hostname);
+    size_t keyLen = hostLen + strlen(params->port) + 2;
+
+    for (host = pool->hosts; host != NULL; host = host->next)
+    {
+        if (strncmp(host->key, params->hostname, hostLen) == 0 && host->key[hostLen] == ':'
+            && strcmp(host->key + hostLen + 1, params->port) == 0)
+        {
+            return host;
+        }
+    }
+
+    if ((host = (struct poolhost*)calloc(1, sizeof(struct poolhost))) == NULL)
+    {
+        return NULL;
+    }
+
+    host->key = (char*)malloc(keyLen);
+    host->stack = (struct idleconnection*)calloc(pool->maxPerHost, sizeof(struct idleconnection));
+    host->inuse = (int*)calloc(pool->maxPerHost, sizeof(int));
+    if (host->key == NULL || host->stack == NULL || host->inuse == NULL)
+    {
+        free(host->key);
+        free(host->stack);
+        free(host->inuse);
+        free(host);
+        return NULL;
+    }
+
+    snprintf(host->key, keyLen, "%s:%s", params->hostname, params->port);
+    host->next = pool->hosts;
+    pool->hosts = host;
+    return host;
+}
+
+/* check without blocking that an idle connection was not closed by the
+   peer and has no stray data waiting */
+static int is_connection_alive(int socket)
+{
+    byte probe;
+    ssize_t result = recv(socket, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+
+    return result < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+}
+
+/* count SOCKET as in use on HOST. Called with the lock */
+static void track_connection(struct poolhost* host, int socket)
+{
+    host->inuse[host->active++] = socket;
+}
+
+/* stop counting SOCKET as in use on HOST. Called with the lock. Return
+   -1 when the pool did not hand it out */
+static int untrack_connection(struct poolhost* host, int socket)
+{
+    int i;
+
+    for (i = 0; i < host->active; i++)
+    {
+        if (host->inuse[i] == socket)
+        {
+            host->inuse[i] = host->inuse[--host->active];
+            return 0;
+        }
+    }
+
+    return -1;
+}
+
+int acquire_connection(struct connpool* pool, struct clientparams* params)
+{
+    struct poolhost* host = NULL;
+    struct addrinfo* hostinfo = NULL;
+    int socket = 0;
+
+    pthread_mutex_lock(&pool->lock);
+    if ((host = find_pool_host(pool, params)) == NULL)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return ERR_CANNOT_GET_ADDR_INFO;
+    }
+
+    // most recently used first, the most likely to be alive
+    while (host->idle > 0)
+    {
+        socket = host->stack[--host->idle].socket;
+        if (is_connection_alive(socket))
+        {
+            track_connection(host, socket);
+            pthread_mutex_unlock(&pool->lock);
+            return socket;
+        }
+        close(socket);
+    }
+
+    if (host->active >= pool->maxPerHost)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        print_error("Too many connections to %s", host->key);
+        return ERR_TOO_MANY_CONNECTIONS;
+    }
+
+    // reserve the slot, the connection is made without the lock
+    track_connection(host, -1);
+    pthread_mutex_unlock(&pool->lock);
+
+    // resolved for each new connection, the DNS cache keeps the addresses
+    // until their time to live expires
+    if (prepare_connection(params, &hostinfo) < 0)
+    {
+        socket = ERR_CANNOT_GET_ADDR_INFO;
+    }
+    else
+    {
+        socket = connect_to_host(hostinfo);
+        free_addrinfo_copy(hostinfo);
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    untrack_connection(host, -1);
+    if (socket >= 0)
+    {
+        track_connection(host, socket);
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return socket;
+}
+
+void release_connection(struct connpool* pool, struct clientparams* params,
+                        int socket, int reusable)
+{
+    struct poolhost* host = NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    host = find_pool_host(pool, params);
+
+    // a socket the pool did not hand out, or released twice, may be one of
+    // its idle connections by now, it is left alone
+    if (host != NULL && untrack_connection(host, socket) < 0)
+    {
+        pthread_mutex_unlock(&pool->lock);
+        print_error("Connection [%d] released to %s was not acquired from the pool",
+                    socket, host->key);
+        return;
+    }
+
+    if (host == NULL || reusable == 0 || host->idle >= pool->maxPerHost 
+        || !is_connection_alive(socket))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        close(socket);
+        return;
+    }
+
+    host->stack[host->idle].socket = socket;
+    host->stack[host->idle].since = time(NULL);
+    host->idle++;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+int evict_idle_connections(struct connpool* pool)
+{
+    struct poolhost* host = NULL;
+    time_t limit = time(NULL) - pool->idleTimeout;
+    int evicted = 0;
+    int i, kept;
+
+    pthread_mutex_lock(&pool->lock);
+    for (host = pool->hosts; host != NULL; host = host->next)
+    {
+        // the oldest connections are at the bottom of the stack
+        for (i = 0; i < host->idle && host->stack[i].since <= limit; i++)
+        {
+            close(host->stack[i].socket);
+            evicted++;
+        }
+
+        if (i > 0)
+        {
+            kept = host->idle - i;
+            memmove(host->stack, host->stack + i, kept * sizeof(struct idleconnection));
+            host->idle = kept;
+        }
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    return evicted;
+}
+
+void destroy_connection_pool(struct connpool* pool)
+{
+    struct poolhost* host = NULL;
+    int i;
+
+    pthread_mutex_lock(&pool->lock);
+    pool->stopped = 1;
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->lock);
+    pthread_join(pool->evictor, NULL);
+
+    while ((host = pool->hosts) != NULL)
+    {
+        for (i = 0; i < host->idle; i++)
+        {
+            close(host->stack[i].socket);
+        }
+
+        pool->hosts = host->next;
+        free(host->inuse);
+        free(host->stack);
+        free(host->key);
+        free(host);
+    }
+
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->wakeup);
+    free(pool);
 }
@@ -27,8 +27,10 @@
 #ifndef CLIENT_H_
 #define CLIENT_H_
 
+#include <netdb.h>
 #include <netinet/in.h>
 #include "internlog.h"
+#include "trace.h"
 
 /* defining a byte on unsigned int on 8 bits */
 typedef u_int8_t byte;
@@ -42,24 +44,155 @@ struct clientparams
     int type;
   };
   
+/* Buffer receiving data from a host. It is either provided by the caller
+   with a fixed size, or allocated and grown geometrically up to maximum */
+struct recvbuffer
+  {
+    byte* data;
+    size_t length;      // bytes received
+    size_t capacity;    // bytes available in data
+    size_t maximum;     // biggest capacity to grow to, 0 for no limit
+    int growable;       // data is allocated by the buffer
+  };
+
+/* Called with each __chunk received, return non zero to stop receiving */
+typedef int (*receive_callback)(byte* __chunk, size_t __length, void* __context);
+
+/* Pool of connections kept alive between requests, keyed by host:port */
+struct connpool;
+  
 /* Create a socket client and resolve the hostname supplied by the __params.
-   The __addrinfo will contain the necessary data to make a connection.
-   The return value is 0 for success, otherwise negative int, errno will
-   be set  */
+   The __addrinfo will contain the necessary data to make a connection,
+   to be released with free_addrinfo_copy. The return value is 0 for
+   success, otherwise negative int, errno will be set  */
 extern int prepare_connection(struct clientparams* __param, 
                               struct addrinfo** __addrinfo);
 
 /* Connect to hostname specified in the __addrinfo data structures.
    Will return the socket file descriptor on success, otherwise negative
-   int, errno will be set.  */
+   int, errno will be set. All the addresses are tried, as with
+   connect_to_host_timeout without deadline */
 extern int connect_to_host(struct addrinfo* __addrinfo);
 
+/* Connect to one of the addresses in __addrinfo. A non-blocking connect
+   is started on each address in turn, alternating the address families,
+   250 ms apart or as soon as the previous one fails. The first to
+   succeed is returned as a blocking socket and the others are closed.
+   __timeout is the deadline in milliseconds, 0 for none. Return the
+   socket, otherwise negative int, errno will be set */
+extern int connect_to_host_timeout(struct addrinfo* __addrinfo, int __timeout);
+
 /* Send data to the host. Return 0 if all the byte are sent, otherwise will
    return a negative value. errno may not be set */
 extern int send_data_to_host(int __socket, byte* __data, size_t __length);
 
+/* Send a header and a body to the host, the header held back so both
+   leave in the same segments. A body of the zerocopy threshold or more is
+   sent with MSG_ZEROCOPY, its pages read by the device instead of copied,
+   and the call returns once the kernel released them so __body can be
+   reused. Return 0 if all the bytes are sent, otherwise negative int */
+extern int send_bulk_to_host(int __socket, byte* __header, size_t __headerLength,
+                             byte* __body, size_t __bodyLength);
+
+/* Set the body size from which send_bulk_to_host uses MSG_ZEROCOPY,
+   32 KiB by default */
+extern void set_zerocopy_threshold(size_t __threshold);
+
 /* Wait and read any data sent from the SOCKET. Memory will be allocated 
    and the data copied in CONTENT. */
 extern size_t waiting_data_from_host(int socket, byte** content, int block);
 
+/* Prepare __buffer to receive data in __data of __capacity bytes. When
+   __data is NULL, the memory is allocated on the first receive and grows
+   up to __maximum bytes, 0 for no limit */
+extern void init_receive_buffer(struct recvbuffer* __buffer, byte* __data, 
+                                size_t __capacity, size_t __maximum);
+
+/* Free the memory allocated by the buffer */
+extern void free_receive_buffer(struct recvbuffer* __buffer);
+
+/* Receive from __socket, appending to __buffer, until the peer closes the
+   connection or, with MSG_DONTWAIT, no more data is available. The data
+   is copied once, from the kernel to the buffer. Return the number of
+   bytes received, otherwise negative int when the buffer is full or the
+   receive failed */
+extern ssize_t receive_into_buffer(int __socket, struct recvbuffer* __buffer, int __flags);
+
+/* Drop the first __count bytes of __buffer, once the message they hold
+   is handled. The bytes of the next message, if any, are kept */
+extern void consume_receive_buffer(struct recvbuffer* __buffer, size_t __count);
+
+/* Receive until __buffer holds at least __count bytes. Data received
+   after them stays in the buffer for the next message. Return __count,
+   0 with MSG_DONTWAIT when more data is needed, otherwise negative int
+   when the connection is closed before, the buffer is full or the
+   receive failed */
+extern ssize_t receive_exact(int __socket, struct recvbuffer* __buffer, size_t __count, 
+                             int __flags);
+
+/* Receive until __buffer holds the __delim sequence of __length bytes.
+   Return the length of the message, delimiter included */
+extern ssize_t receive_until(int __socket, struct recvbuffer* __buffer, const byte* __delim,
+                             size_t __length, int __flags);
+
+/* Receive until __buffer holds a complete HTTP message, using its
+   Content-Length or chunked encoding. A response without length ends
+   when the peer closes the connection. Return the length of the message */
+extern ssize_t receive_http_message(int __socket, struct recvbuffer* __buffer, int __flags);
+
+/* Length of the complete HTTP message at the start of __data, 0 if it is
+   incomplete or ends when the connection is closed, negative int if it
+   is invalid */
+extern ssize_t http_message_length(const byte* __data, size_t __length);
+
+/* As http_message_length, __untilClose set when the message has no
+   length and ends when the peer closes the connection. All the data
+   received until then is the message */
+extern ssize_t frame_http_message(const byte* __data, size_t __length, int* __untilClose);
+
+/* Parse the chunk size line at the start of __data, made of hex digits
+   only and optionally followed by extensions. Store the size in __size.
+   Return the length of the line, 0 if it is incomplete, otherwise
+   negative int when it is invalid or the size overflows */
+extern ssize_t parse_chunk_size(const byte* __data, size_t __length, size_t* __size);
+
+/* Tell if the Transfer-Encoding value of __length bytes at __value ends
+   with the chunked coding, the only one framing the body */
+extern int is_chunked_encoding(const char* __value, size_t __length);
+
+/* Receive from __socket and give each chunk to __callback, reusing
+   __buffer of __size bytes for every chunk so any amount of data is
+   received in constant memory. A buffer on the stack is used when
+   __buffer is NULL. Stops when the peer closes the connection, when
+   the callback returns non zero or, with MSG_DONTWAIT, when no more data
+   is available. Return the number of bytes received, otherwise
+   negative int */
+extern ssize_t stream_data_from_host(int __socket, byte* __buffer, size_t __size, int __flags,
+                                     receive_callback __callback, void* __context);
+
+/* Create a pool keeping at most __maxPerHost connections, idle or in use,
+   to each host. Idle connections are closed after __idleTimeout seconds
+   by a background thread. Return NULL if the pool cannot be created */
+extern struct connpool* create_connection_pool(int __maxPerHost, int __idleTimeout);
+
+/* Get a connection to the host of __params, reusing an idle one that is
+   still alive when possible. The host is resolved for each new
+   connection, enable the DNS cache to keep its addresses between them.
+   Return the socket, otherwise negative int */
+extern int acquire_connection(struct connpool* __pool, struct clientparams* __params);
+
+/* Give back a connection taken with acquire_connection. When __reusable is
+   0, or the response was not fully read, the connection is closed. A
+   socket the pool did not hand out is ignored */
+extern void release_connection(struct connpool* __pool, struct clientparams* __params,
+                               int __socket, int __reusable);
+
+/* Close the connections idle for longer than the timeout. Return the
+   number of connections closed */
+extern int evict_idle_connections(struct connpool* __pool);
+
+/* Close every idle connection and release the pool. Connections still in
+   use must be released before */
+extern void destroy_connection_pool(struct connpool* __pool);
+
 #endif
@@ -0,0 +1,147 @@
+/*  Implementation of the connection table
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include "connection.h"
+#include "internlog.h"
+
+/* error code */
+const int ERR_CANNOT_ALLOCATE_TABLE = -1;
+
+int conntable_create(struct conntable* table, u_int32_t capacity)
+{
+    struct rlimit limit;
+    void* slots = NULL;
+
+    if (capacity == 0)
+    {
+        if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+        {
+            return ERR_CANNOT_ALLOCATE_TABLE;
+        }
+        capacity = (u_int32_t)limit.rlim_cur;
+    }
+
+    // anonymous pages are zero filled and only committed when touched,
+    // so a table sized for a million sockets costs nothing until used
+    slots = mmap(NULL, (size_t)capacity * sizeof(struct connection),
+                 PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE,
+                 -1, 0);
+    if (slots == MAP_FAILED)
+    {
+        print_error("Cannot reserve a connection table of %u slots", capacity);
+        return ERR_CANNOT_ALLOCATE_TABLE;
+    }
+
+    table->slots = (struct connection*)slots;
+    table->capacity = capacity;
+    table->count = 0;
+    return 0;
+}
+
+struct connection* conntable_add(struct conntable* table, int socket)
+{
+    struct connection* conn = NULL;
+
+    if (socket < 0 || (u_int32_t)socket >= table->capacity)
+    {
+        print_error("Socket [%d] does not fit in the connection table", socket);
+        return NULL;
+    }
+
+    conn = &table->slots[socket];
+    if (conn->status == CONN_FREE)
+    {
+        table->count++;
+    }
+
+    conn->status = CONN_IDLE;
+    conn->flags = 0;
+    conn->traced = 0;
+    conn->lastactive = (u_int32_t)time(NULL);
+    conn->state = NULL;
+    return conn;
+}
+
+struct connection* conntable_get(struct conntable* table, int socket)
+{
+    if (socket < 0 || (u_int32_t)socket >= table->capacity
+        || table->slots[socket].status == CONN_FREE)
+    {
+        return NULL;
+    }
+
+    return &table->slots[socket];
+}
+
+void conntable_remove(struct conntable* table, int socket)
+{
+    struct connection* conn = conntable_get(table, socket);
+
+    if (conn != NULL)
+    {
+        connection_release_state(conn);
+        memset(conn, 0, sizeof(struct connection));
+        table->count--;
+    }
+}
+
+void conntable_destroy(struct conntable* table)
+{
+    u_int32_t i;
+
+    if (table->slots == NULL)
+    {
+        return;
+    }
+
+    for (i = 0; i < table->capacity && table->count > 0; i++)
+    {
+        conntable_remove(table, i);
+    }
+
+    munmap(table->slots, (size_t)table->capacity * sizeof(struct connection));
+    table->slots = NULL;
+    table->capacity = 0;
+}
+
+void* connection_state(struct connection* conn, size_t size)
+{
+    if (conn->state == NULL)
+    {
+        conn->state = calloc(1, size);
+    }
+
+    return conn->state;
+}
+
+void connection_release_state(struct connection* conn)
+{
+    free(conn->state);
+    conn->state = NULL;
+}
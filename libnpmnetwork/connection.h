@@ -0,0 +1,90 @@
+/*  Prototype for the connection table
+
+    This prototype defines a compact representation of the connections
+    held by an event driven server. Each connection is a small structure
+    stored in an array indexed by its socket descriptor. No buffer is
+    attached to an idle connection, the state used by a request handler
+    is only allocated the first time it is needed.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef CONNECTION_H_
+#define CONNECTION_H_
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/* status of a slot in the connection table */
+#define CONN_FREE    0   // no connection on this socket
+#define CONN_IDLE    1   // connected, waiting for data
+#define CONN_ACTIVE  2   // the request handler is running
+
+/* One connection, 16 bytes on a 64 bits host. The socket descriptor is
+   the index of the connection in the table and is not stored. */
+struct connection
+  {
+    u_int8_t status;
+    u_int8_t flags;         // free for the request handler to use
+    u_int8_t traced;        // first read reported, used by the event loop
+    u_int8_t reserved;
+    u_int32_t lastactive;   // last activity, in seconds since the epoch
+    void* state;            // handler state, NULL until first needed
+  };
+
+/* Table of connections indexed by socket descriptor */
+struct conntable
+  {
+    struct connection* slots;
+    u_int32_t capacity;
+    u_int32_t count;
+  };
+
+/* Create a table able to hold sockets from 0 to __capacity - 1. When
+   __capacity is 0, the RLIMIT_NOFILE of the process is used. The memory
+   is reserved but only the pages holding a used slot are committed.
+   Return 0 on success, otherwise negative int */
+extern int conntable_create(struct conntable* __table, u_int32_t __capacity);
+
+/* Register a new connection on __socket. Return NULL if the socket does
+   not fit in the table */
+extern struct connection* conntable_add(struct conntable* __table, int __socket);
+
+/* Get the connection registered on __socket, NULL if there is none */
+extern struct connection* conntable_get(struct conntable* __table, int __socket);
+
+/* Release the connection on __socket and its state. The socket is not
+   closed */
+extern void conntable_remove(struct conntable* __table, int __socket);
+
+/* Release the whole table. Sockets are not closed */
+extern void conntable_destroy(struct conntable* __table);
+
+/* Get the state of the connection, allocating __size zeroed bytes on the
+   first call. Return NULL if the memory cannot be allocated */
+extern void* connection_state(struct connection* __conn, size_t __size);
+
+/* Free the state of the connection so an idle connection does not hold
+   any memory. The next call to connection_state allocates a new one */
+extern void connection_release_state(struct connection* __conn);
+
+#endif
@@ -0,0 +1,456 @@
+/*  Implementation of the host resolution cache
+
+    getaddrinfo does not give the time to live of the records it returns,
+    the one of the cache is set by the application.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include "dnscache.h"
+#include "client.h"
+#include "internlog.h"
+
+/* error code */
+const int ERR_CANNOT_ENABLE_DNS_CACHE = -1;
+
+/* number of buckets of the table, a power of 2 */
+#define DNS_CACHE_BUCKETS 256
+
+/* entries kept at most, the expired ones are dropped to make room */
+#define DNS_CACHE_MAX_ENTRIES 4096
+
+/* one resolved host */
+struct dnsentry
+  {
+    char* hostname;
+    char* port;
+    int family;
+    int type;
+    int error;                  // getaddrinfo error, 0 on success
+    struct addrinfo* result;    // owned by the entry
+    time_t expires;
+    int used;                   // looked up since the last resolution
+    struct dnsentry* next;
+  };
+
+int g_dnsCacheEnabled = 0;
+int g_dnsTtl = 0;
+int g_dnsNegativeTtl = 0;
+int g_dnsRefresh = 0;
+int g_dnsStopped = 0;
+int g_dnsRefresherStarted = 0;
+int g_dnsEntries = 0;
+struct dnsentry* g_dnsBuckets[DNS_CACHE_BUCKETS];
+pthread_mutex_t g_dnsLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t g_dnsWakeup = PTHREAD_COND_INITIALIZER;
+pthread_t g_dnsRefresher;
+
+/* FNV-1a hash of the key of an entry */
+static unsigned int dns_hash(struct clientparams* params)
+{
+    unsigned int hash = 2166136261u;
+    const char* c = NULL;
+
+    for (c = params->hostname; *c != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    for (c = params->port; *c != '\0'; c++)
+    {
+        hash = (hash ^ (unsigned char)*c) * 16777619u;
+    }
+    hash = (hash ^ (unsigned int)params->family) * 16777619u;
+    hash = (hash ^ (unsigned int)params->type) * 16777619u;
+
+    return hash & (DNS_CACHE_BUCKETS - 1);
+}
+
+/* copy LIST in nodes holding their address in the same block, released
+   with free_addrinfo_copy */
+static struct addrinfo* copy_addrinfo(const struct addrinfo* list)
+{
+    struct addrinfo* head = NULL;
+    struct addrinfo** tail = &head;
+    struct addrinfo* node = NULL;
+
+    for (; list != NULL; list = list->ai_next)
+    {
+        if ((node = (struct addrinfo*)malloc(sizeof(struct addrinfo) + list->ai_addrlen)) == NULL)
+        {
+            free_addrinfo_copy(head);
+            return NULL;
+        }
+
+        memcpy(node, list, sizeof(struct addrinfo));
+        node->ai_addr = (struct sockaddr*)(node + 1);
+        memcpy(node->ai_addr, list->ai_addr, list->ai_addrlen);
+        node->ai_canonname = list->ai_canonname != NULL ? strdup(list->ai_canonname) : NULL;
+        node->ai_next = NULL;
+
+        *tail = node;
+        tail = &node->ai_next;
+    }
+
+    return head;
+}
+
+void free_addrinfo_copy(struct addrinfo* list)
+{
+    struct addrinfo* next = NULL;
+
+    for (; list != NULL; list = next)
+    {
+        next = list->ai_next;
+        free(list->ai_canonname);
+        free(list);
+    }
+}
+
+/* call the resolver for PARAMS */
+static int dns_resolve(struct clientparams* params, struct addrinfo** result)
+{
+    struct addrinfo hints;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = params->family;
+    hints.ai_socktype = params->type;
+    *result = NULL;
+
+    return getaddrinfo(params->hostname, params->port, &hints, result);
+}
+
+/* tell if the getaddrinfo ERROR may not happen on the next try, such a
+   failure is not cached */
+static int dns_transient(int error)
+{
+    return error == EAI_AGAIN || error == EAI_MEMORY || error == EAI_SYSTEM;
+}
+
+/* find the entry of PARAMS, called with the lock */
+static struct dnsentry* dns_find(struct clientparams* params, unsigned int bucket)
+{
+    struct dnsentry* entry = NULL;
+
+    for (entry = g_dnsBuckets[bucket]; entry != NULL; entry = entry->next)
+    {
+        if (entry->family == params->family && entry->type == params->type
+            && strcmp(entry->hostname, params->hostname) == 0
+            && strcmp(entry->port, params->port) == 0)
+        {
+            return entry;
+        }
+    }
+
+    return NULL;
+}
+
+/* set the result of ENTRY, called with the lock */
+static void dns_store(struct dnsentry* entry, int error, struct addrinfo* result)
+{
+    if (entry->result != NULL)
+    {
+        freeaddrinfo(entry->result);
+    }
+
+    entry->error = error;
+    entry->result = result;
+    entry->expires = time(NULL) + (error == 0 ? g_dnsTtl : g_dnsNegativeTtl);
+    entry->used = 0;
+}
+
+/* release ENTRY, called with the lock */
+static void dns_free(struct dnsentry* entry)
+{
+    if (entry->result != NULL)
+    {
+        freeaddrinfo(entry->result);
+    }
+    free(entry->hostname);
+    free(entry->port);
+    free(entry);
+    g_dnsEntries--;
+}
+
+/* drop the entries expired before NOW, called with the lock */
+static void dns_evict(time_t now)
+{
+    struct dnsentry** link = NULL;
+    struct dnsentry* entry = NULL;
+    int bucket;
+
+    for (bucket = 0; bucket < DNS_CACHE_BUCKETS; bucket++)
+    {
+        for (link = &g_dnsBuckets[bucket]; (entry = *link) != NULL;)
+        {
+            if (entry->expires <= now)
+            {
+                *link = entry->next;
+                dns_free(entry);
+            }
+            else
+            {
+                link = &entry->next;
+            }
+        }
+    }
+}
+
+/* add or update the entry of PARAMS, called with the lock. Return NULL
+   when the entry cannot be added, the cache being full */
+static struct dnsentry* dns_insert(struct clientparams* params, int error, struct addrinfo* result)
+{
+    unsigned int bucket = dns_hash(params);
+    struct dnsentry* entry = dns_find(params, bucket);
+
+    if (entry == NULL)
+    {
+        if (g_dnsEntries >= DNS_CACHE_MAX_ENTRIES)
+        {
+            dns_evict(time(NULL));
+        }
+        if (g_dnsEntries >= DNS_CACHE_MAX_ENTRIES
+            || (entry = (struct dnsentry*)calloc(1, sizeof(struct dnsentry))) == NULL)
+        {
+            return NULL;
+        }
+        g_dnsEntries++;
+
+        entry->hostname = strdup(params->hostname);
+        entry->port = strdup(params->port);
+        entry->family = params->family;
+        entry->type = params->type;
+        entry->next = g_dnsBuckets[bucket];
+        g_dnsBuckets[bucket] = entry;
+    }
+
+    dns_store(entry, error, result);
+    return entry;
+}
+
+/* body of the thread resolving again the entries about to expire */
+static void* run_dns_refresher(void* arg)
+{
+    struct clientparams params;
+    struct addrinfo* result = NULL;
+    struct dnsentry* entry = NULL;
+    struct timespec deadline;
+    time_t limit;
+    int bucket, error;
+
+    pthread_mutex_lock(&g_dnsLock);
+    while (g_dnsStopped == 0)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += 1;
+        pthread_cond_timedwait(&g_dnsWakeup, &g_dnsLock, &deadline);
+
+        dns_evict(time(NULL));
+
+        limit = time(NULL) + g_dnsRefresh;
+        for (bucket = 0; bucket < DNS_CACHE_BUCKETS && g_dnsStopped == 0; bucket++)
+        {
+            for (entry = g_dnsBuckets[bucket]; entry != NULL; entry = entry->next)
+            {
+                if (entry->used == 0 || entry->expires > limit)
+                {
+                    continue;
+                }
+
+                // resolve without the lock, the lookups keep being served
+                params.hostname = strdup(entry->hostname);
+                params.port = strdup(entry->port);
+                params.family = entry->family;
+                params.type = entry->type;
+                entry->used = 0;
+                pthread_mutex_unlock(&g_dnsLock);
+
+                error = dns_resolve(&params, &result);
+
+                pthread_mutex_lock(&g_dnsLock);
+                entry = dns_find(&params, dns_hash(&params));
+
+                // a failure keeps the addresses known until they expire
+                if (error != 0 && entry != NULL && entry->error == 0)
+                {
+                    print_info("Cannot refresh %s, keeping its addresses", params.hostname);
+                }
+                else if (g_dnsCacheEnabled && !dns_transient(error)
+                         && dns_insert(&params, error, result) != NULL)
+                {
+                    result = NULL;
+                }
+                if (result != NULL)
+                {
+                    freeaddrinfo(result);
+                }
+                free(params.hostname);
+                free(params.port);
+
+                // the bucket may have changed meanwhile, scan it again later
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&g_dnsLock);
+
+    return NULL;
+}
+
+int enable_dns_cache(int ttl, int negativeTtl, int refresh)
+{
+    if (ttl < 1 || negativeTtl < 0 || refresh < 0)
+    {
+        return ERR_CANNOT_ENABLE_DNS_CACHE;
+    }
+
+    disable_dns_cache();
+
+    pthread_mutex_lock(&g_dnsLock);
+    g_dnsTtl = ttl;
+    g_dnsNegativeTtl = negativeTtl;
+    g_dnsRefresh = refresh;
+    g_dnsStopped = 0;
+    g_dnsCacheEnabled = 1;
+
+    if (refresh > 0)
+    {
+        if (pthread_create(&g_dnsRefresher, NULL, run_dns_refresher, NULL) != 0)
+        {
+            pthread_mutex_unlock(&g_dnsLock);
+            print_error("Cannot start the DNS cache refresher");
+            disable_dns_cache();
+            return ERR_CANNOT_ENABLE_DNS_CACHE;
+        }
+        g_dnsRefresherStarted = 1;
+    }
+    pthread_mutex_unlock(&g_dnsLock);
+
+    return 0;
+}
+
+void disable_dns_cache(void)
+{
+    int running = 0;
+
+    pthread_mutex_lock(&g_dnsLock);
+    running = g_dnsRefresherStarted;
+    g_dnsRefresherStarted = 0;
+    g_dnsCacheEnabled = 0;
+    g_dnsStopped = 1;
+    pthread_cond_signal(&g_dnsWakeup);
+    pthread_mutex_unlock(&g_dnsLock);
+
+    if (running)
+    {
+        pthread_join(g_dnsRefresher, NULL);
+    }
+
+    flush_dns_cache();
+}
+
+int is_dns_cache_enabled(void)
+{
+    return g_dnsCacheEnabled;
+}
+
+int prewarm_dns_cache(struct clientparams* params, int count)
+{
+    struct addrinfo* result = NULL;
+    int resolved = 0;
+    int i;
+
+    for (i = 0; i < count; i++)
+    {
+        if (resolve_with_cache(&params[i], &result) == 0)
+        {
+            free_addrinfo_copy(result);
+            resolved++;
+        }
+    }
+
+    return resolved;
+}
+
+int resolve_with_cache(struct clientparams* params, struct addrinfo** hostinfo)
+{
+    struct dnsentry* entry = NULL;
+    struct addrinfo* result = NULL;
+    int error = 0;
+
+    pthread_mutex_lock(&g_dnsLock);
+    entry = g_dnsCacheEnabled ? dns_find(params, dns_hash(params)) : NULL;
+    if (entry != NULL && entry->expires > time(NULL))
+    {
+        entry->used = 1;
+        error = entry->error;
+        *hostinfo = error == 0 ? copy_addrinfo(entry->result) : NULL;
+        pthread_mutex_unlock(&g_dnsLock);
+        return error == 0 && *hostinfo == NULL ? EAI_MEMORY : error;
+    }
+    pthread_mutex_unlock(&g_dnsLock);
+
+    // miss, resolve without holding the lock
+    error = dns_resolve(params, &result);
+
+    pthread_mutex_lock(&g_dnsLock);
+    if (g_dnsCacheEnabled && !dns_transient(error)
+        && (entry = dns_insert(params, error, result)) != NULL)
+    {
+        entry->used = 1;
+        *hostinfo = error == 0 ? copy_addrinfo(result) : NULL;
+        pthread_mutex_unlock(&g_dnsLock);
+        return error == 0 && *hostinfo == NULL ? EAI_MEMORY : error;
+    }
+    pthread_mutex_unlock(&g_dnsLock);
+
+    // not cached, the caller still gets a copy
+    *hostinfo = NULL;
+    if (error == 0)
+    {
+        *hostinfo = copy_addrinfo(result);
+        freeaddrinfo(result);
+        error = *hostinfo == NULL ? EAI_MEMORY : 0;
+    }
+    return error;
+}
+
+void flush_dns_cache(void)
+{
+    struct dnsentry* entry = NULL;
+    int bucket;
+
+    pthread_mutex_lock(&g_dnsLock);
+    for (bucket = 0; bucket < DNS_CACHE_BUCKETS; bucket++)
+    {
+        while ((entry = g_dnsBuckets[bucket]) != NULL)
+        {
+            g_dnsBuckets[bucket] = entry->next;
+            dns_free(entry);
+        }
+    }
+    pthread_mutex_unlock(&g_dnsLock);
+}
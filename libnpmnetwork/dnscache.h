@@ -0,0 +1,69 @@
+/*  Prototype for the host resolution cache
+
+    This prototype defines a cache of the results of getaddrinfo used by
+    prepare_connection. Successful resolutions are kept for a time to
+    live, failures for a shorter one. Entries in use can be refreshed by
+    a background thread before they expire so the callers never wait on
+    the resolver for a known host.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef DNSCACHE_H_
+#define DNSCACHE_H_
+
+#include <netdb.h>
+
+struct clientparams;
+
+/* Enable the cache. Resolutions are kept __ttl seconds, failures
+   __negativeTtl seconds. Temporary failures (EAI_AGAIN, EAI_MEMORY,
+   EAI_SYSTEM) are not kept. When __refresh is not 0, a background thread
+   resolves again the entries used since their last resolution __refresh
+   seconds before they expire, a failure keeping the previous addresses
+   until then, and drops the expired entries. At most 4096 entries are
+   kept. Return 0 on success, otherwise negative int */
+extern int enable_dns_cache(int __ttl, int __negativeTtl, int __refresh);
+
+/* Disable the cache and release all its entries */
+extern void disable_dns_cache(void);
+
+/* Tell if the cache is enabled */
+extern int is_dns_cache_enabled(void);
+
+/* Resolve the __count hosts of __params and keep them in the cache, to be
+   called at startup. Return the number of hosts resolved */
+extern int prewarm_dns_cache(struct clientparams* __params, int __count);
+
+/* Get the addresses of the host of __params from the cache, resolving
+   them on a miss or when the cache is disabled. __addrinfo receives a
+   copy owned by the caller, to be released with free_addrinfo_copy.
+   Return 0 on success, otherwise the getaddrinfo error, cached or not */
+extern int resolve_with_cache(struct clientparams* __params, struct addrinfo** __addrinfo);
+
+/* Release the addresses given by resolve_with_cache */
+extern void free_addrinfo_copy(struct addrinfo* __addrinfo);
+
+/* Drop every entry of the cache */
+extern void flush_dns_cache(void);
+
+#endif
@@ -0,0 +1,930 @@
+/*  Implementation of the concurrent fetch engine
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include "fetch.h"
+#include "http.h"
+#include "resolver.h"
+#include "dnscache.h"
+#include "trace.h"
+#include "internlog.h"
+
+/* error codes, reported in fetchrequest.error */
+const int ERR_FETCH_CANNOT_RESOLVE   = -1;
+const int ERR_FETCH_CANNOT_CONNECT   = -2;
+const int ERR_FETCH_INVALID_RESPONSE = -3;
+const int ERR_FETCH_TIMEOUT          = -4;
+const int ERR_FETCH_CONNECTION_LOST  = -5;
+
+/* times a request is sent again after its connection closed */
+#define FETCH_MAX_RETRIES 2
+
+/* events handled per epoll_wait and interval of the timeout checks, ms */
+#define FETCH_EVENTS 256
+#define FETCH_TICK   50
+
+/* threads resolving the host names */
+#define FETCH_RESOLVER_THREADS 4
+
+#define FETCH_HOST_BUCKETS 256
+
+/* resolution of a host */
+#define HOST_UNRESOLVED 0
+#define HOST_RESOLVING  1
+#define HOST_RESOLVED   2
+#define HOST_FAILED     3
+
+/* a queued request */
+struct fetchjob
+  {
+    struct fetchrequest* request;
+    int retries;
+    struct fetchjob* next;
+  };
+
+struct jobqueue
+  {
+    struct fetchjob* head;
+    struct fetchjob* tail;
+    int count;
+  };
+
+struct fetchhost
+  {
+    struct fetchengine* engine;
+    char* hostname;
+    char* port;
+    int state;
+    struct addrinfo* addrinfo;
+    u_int64_t resolved;
+    struct jobqueue jobs;
+    int connections;
+    struct fetchconn* conns;
+    int waiting;                // in the queue of hosts waiting for a connection
+    struct fetchhost* nextwaiting;
+    struct fetchhost* next;     // in its bucket
+  };
+
+struct fetchconn
+  {
+    int socket;
+    int connected;
+    int responses;              // received, the next requests reuse it
+    int pipelining;             // the host accepts several requests in flight
+    int closing;                // the host announced it closes after the response
+    struct fetchhost* host;
+    struct addrinfo* address;   // address tried, the next ones on failure
+    struct jobqueue inflight;
+    byte* out;                  // requests not sent yet
+    size_t outlength;
+    size_t outcapacity;
+    size_t outsent;
+    byte* in;                   // responses not complete yet
+    size_t inlength;
+    size_t incapacity;
+    u_int64_t connectedat;
+    u_int64_t deadline;
+    struct fetchconn* prev;     // in the engine list
+    struct fetchconn* next;
+    struct fetchconn* hostnext; // in the host list
+  };
+
+struct fetchengine
+  {
+    struct fetchparams params;
+    int epoll;
+    struct resolver* resolver;
+    struct fetchhost* buckets[FETCH_HOST_BUCKETS];
+    struct fetchhost* waitinghead;
+    struct fetchhost* waitingtail;
+    struct fetchconn* conns;
+    int connections;
+    int outstanding;
+    int completed;
+  };
+
+static void schedule_host(struct fetchhost* host);
+
+static void job_push(struct jobqueue* queue, struct fetchjob* job)
+{
+    job->next = NULL;
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = job;
+    }
+    else
+    {
+        queue->head = job;
+    }
+    queue->tail = job;
+    queue->count++;
+}
+
+static struct fetchjob* job_pop(struct jobqueue* queue)
+{
+    struct fetchjob* job = queue->head;
+
+    if (job != NULL)
+    {
+        queue->head = job->next;
+        if (queue->head == NULL)
+        {
+            queue->tail = NULL;
+        }
+        queue->count--;
+    }
+
+    return job;
+}
+
+/* give the outcome of JOB to the callback and release it */
+static void complete_job(struct fetchengine* engine, struct fetchjob* job, int error,
+                         const byte* response, size_t length)
+{
+    struct fetchrequest* request = job->request;
+
+    request->error = error;
+    request->status = 0;
+    request->timings.completed = trace_clock();
+    if (error == 0)
+    {
+        // "HTTP/1.1 200 ..."
+        if (length > 12 && memcmp(response, "HTTP/", 5) == 0)
+        {
+            request->status = atoi((const char*)response + 9);
+        }
+        engine->completed++;
+    }
+
+    engine->outstanding--;
+    free(job);
+    engine->params.callback(request, response, length);
+}
+
+static void fail_jobs(struct fetchengine* engine, struct jobqueue* queue, int error)
+{
+    struct fetchjob* job = NULL;
+
+    while ((job = job_pop(queue)) != NULL)
+    {
+        complete_job(engine, job, error, NULL, 0);
+    }
+}
+
+static struct fetchhost* find_host(struct fetchengine* engine, struct fetchrequest* request)
+{
+    unsigned int bucket = 2166136261u;
+    const char* c = NULL;
+    struct fetchhost* host = NULL;
+
+    for (c = request->hostname; *c != '\0'; c++)
+    {
+        bucket = (bucket ^ (unsigned char)*c) * 16777619u;
+    }
+    for (c = request->port; *c != '\0'; c++)
+    {
+        bucket = (bucket ^ (unsigned char)*c) * 16777619u;
+    }
+    bucket &= FETCH_HOST_BUCKETS - 1;
+
+    for (host = engine->buckets[bucket]; host != NULL; host = host->next)
+    {
+        if (strcmp(host->hostname, request->hostname) == 0 
+            && strcmp(host->port, request->port) == 0)
+        {
+            return host;
+        }
+    }
+
+    if ((host = (struct fetchhost*)calloc(1, sizeof(struct fetchhost))) == NULL)
+    {
+        return NULL;
+    }
+
+    host->engine = engine;
+    host->hostname = strdup(request->hostname);
+    host->port = strdup(request->port);
+    host->next = engine->buckets[bucket];
+    engine->buckets[bucket] = host;
+    return host;
+}
+
+static void on_host_resolved(int error, struct addrinfo* addrinfo, void* ctx)
+{
+    struct fetchhost* host = (struct fetchhost*)ctx;
+
+    host->resolved = trace_clock();
+    if (error != 0 || addrinfo == NULL)
+    {
+        print_error("Cannot resolve %s: %s", host->hostname, gai_strerror(error));
+        host->state = HOST_FAILED;
+    }
+    else
+    {
+        host->addrinfo = addrinfo;
+        host->state = HOST_RESOLVED;
+    }
+
+    schedule_host(host);
+}
+
+static int append_output(struct fetchconn* conn, const char* data, size_t length)
+{
+    byte* out = NULL;
+    size_t capacity = conn->outcapacity > 0 ? conn->outcapacity : 512;
+
+    while (conn->outlength + length > capacity)
+    {
+        capacity *= 2;
+    }
+    if (capacity != conn->outcapacity)
+    {
+        if ((out = (byte*)realloc(conn->out, capacity)) == NULL)
+        {
+            return -1;
+        }
+        conn->out = out;
+        conn->outcapacity = capacity;
+    }
+
+    memcpy(conn->out + conn->outlength, data, length);
+    conn->outlength += length;
+    return 0;
+}
+
+static void watch_connection(struct fetchengine* engine, struct fetchconn* conn, int op)
+{
+    struct epoll_event event;
+
+    event.events = EPOLLIN | (conn->outsent < conn->outlength || !conn->connected ? EPOLLOUT : 0);
+    event.data.ptr = conn;
+    epoll_ctl(engine->epoll, op, conn->socket, &event);
+}
+
+/* write the request of JOB to CONN, sent as soon as it is writable */
+static void assign_job(struct fetchengine* engine, struct fetchconn* conn, struct fetchjob* job)
+{
+    struct fetchrequest* request = job->request;
+    char head[1024];
+    int length = 0;
+    int idle = conn->outsent == conn->outlength;
+
+    length = snprintf(head, sizeof(head), "GET %s HTTP/1.1\r\nHost: %s%s%s\r\n",
+                      request->path, request->hostname,
+                      strcmp(request->port, "80") == 0 ? "" : ":",
+                      strcmp(request->port, "80") == 0 ? "" : request->port);
+
+    if (length >= (int)sizeof(head) || append_output(conn, head, length) < 0
+        || (request->headers != NULL 
+            && append_output(conn, request->headers, strlen(request->headers)) < 0)
+        || append_output(conn, "\r\n", 2) < 0)
+    {
+        complete_job(engine, job, ERR_FETCH_INVALID_RESPONSE, NULL, 0);
+        return;
+    }
+
+    request->timings.resolved = conn->host->resolved;
+    request->reused = conn->responses > 0;
+    job_push(&conn->inflight, job);
+
+    if (conn->connected && idle)
+    {
+        watch_connection(engine, conn, EPOLL_CTL_MOD);
+    }
+}
+
+/* start a non-blocking connect to the current address of CONN, moving to
+   the next addresses on immediate failure */
+static int start_connect(struct fetchengine* engine, struct fetchconn* conn)
+{
+    int one = 1;
+
+    for (; conn->address != NULL; conn->address = conn->address->ai_next)
+    {
+        conn->socket = socket(conn->address->ai_family, 
+                              conn->address->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC,
+                              conn->address->ai_protocol);
+        if (conn->socket < 0)
+        {
+            continue;
+        }
+
+        // pipelined requests are small, do not hold them back
+        setsockopt(conn->socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        if (connect(conn->socket, conn->address->ai_addr, conn->address->ai_addrlen) == 0
+            || errno == EINPROGRESS)
+        {
+            conn->deadline = trace_clock() + (u_int64_t)engine->params.timeout * 1000000;
+            watch_connection(engine, conn, EPOLL_CTL_ADD);
+            return 0;
+        }
+
+        close(conn->socket);
+        conn->socket = -1;
+    }
+
+    return -1;
+}
+
+static struct fetchconn* open_fetch_connection(struct fetchengine* engine, struct fetchhost* host)
+{
+    struct fetchconn* conn = NULL;
+
+    if ((conn = (struct fetchconn*)calloc(1, sizeof(struct fetchconn))) == NULL)
+    {
+        return NULL;
+    }
+
+    // the connect completes in the loop, the addresses are tried in turn
+    conn->host = host;
+    conn->socket = -1;
+    conn->address = host->addrinfo;
+    if (start_connect(engine, conn) < 0)
+    {
+        free(conn);
+        return NULL;
+    }
+
+    conn->next = engine->conns;
+    if (engine->conns != NULL)
+    {
+        engine->conns->prev = conn;
+    }
+    engine->conns = conn;
+    engine->connections++;
+
+    conn->hostnext = host->conns;
+    host->conns = conn;
+    host->connections++;
+    return conn;
+}
+
+static int accepts_job(struct fetchengine* engine, struct fetchconn* conn)
+{
+    if (conn->closing)
+    {
+        return 0;
+    }
+
+    return conn->pipelining ? conn->inflight.count < engine->params.pipelinedepth
+                            : conn->inflight.count == 0;
+}
+
+/* give the queued requests of HOST to its connections, opening new ones
+   within the limits */
+static void schedule_host(struct fetchhost* host)
+{
+    struct fetchengine* engine = host->engine;
+    struct fetchconn* conn = NULL;
+
+    if (host->jobs.count == 0)
+    {
+        return;
+    }
+
+    switch (host->state)
+    {
+      case HOST_UNRESOLVED:
+        host->state = HOST_RESOLVING;
+        {
+            struct clientparams params = { host->hostname, host->port, AF_UNSPEC, SOCK_STREAM };
+            if (resolve_async(engine->resolver, &params, &on_host_resolved, host) < 0)
+            {
+                host->state = HOST_FAILED;
+                fail_jobs(engine, &host->jobs, ERR_FETCH_CANNOT_RESOLVE);
+            }
+        }
+        return;
+      case HOST_RESOLVING:
+        return;
+      case HOST_FAILED:
+        fail_jobs(engine, &host->jobs, ERR_FETCH_CANNOT_RESOLVE);
+        return;
+    }
+
+    // fill the connections already open, one request each until the
+    // host proved it keeps them alive
+    for (conn = host->conns; conn != NULL && host->jobs.count > 0; conn = conn->hostnext)
+    {
+        while (host->jobs.count > 0 && accepts_job(engine, conn))
+        {
+            assign_job(engine, conn, job_pop(&host->jobs));
+        }
+    }
+
+    while (host->jobs.count > 0 && host->connections < engine->params.maxperhost)
+    {
+        if (engine->connections >= engine->params.maxconnections)
+        {
+            if (!host->waiting)
+            {
+                host->waiting = 1;
+                host->nextwaiting = NULL;
+                if (engine->waitingtail != NULL)
+                {
+                    engine->waitingtail->nextwaiting = host;
+                }
+                else
+                {
+                    engine->waitinghead = host;
+                }
+                engine->waitingtail = host;
+            }
+            return;
+        }
+
+        if ((conn = open_fetch_connection(engine, host)) == NULL)
+        {
+            print_error("Cannot connect to %s:%s", host->hostname, host->port);
+            if (host->connections == 0)
+            {
+                fail_jobs(engine, &host->jobs, ERR_FETCH_CANNOT_CONNECT);
+            }
+            return;
+        }
+
+        assign_job(engine, conn, job_pop(&host->jobs));
+    }
+}
+
+/* let the hosts waiting for a connection use the free ones */
+static void wake_waiting_hosts(struct fetchengine* engine)
+{
+    struct fetchhost* host = NULL;
+
+    while (engine->waitinghead != NULL && engine->connections < engine->params.maxconnections)
+    {
+        host = engine->waitinghead;
+        engine->waitinghead = host->nextwaiting;
+        if (engine->waitinghead == NULL)
+        {
+            engine->waitingtail = NULL;
+        }
+        host->waiting = 0;
+        schedule_host(host);
+    }
+}
+
+/* close CONN. The request in front fails with ERROR when it is not 0,
+   the others are queued again on the host */
+static void close_fetch_connection(struct fetchengine* engine, struct fetchconn* conn, int error)
+{
+    struct fetchhost* host = conn->host;
+    struct fetchconn** link = NULL;
+    struct fetchjob* job = NULL;
+    struct jobqueue retry = { NULL, NULL, 0 };
+
+    if (error != 0 && (job = job_pop(&conn->inflight)) != NULL)
+    {
+        complete_job(engine, job, error, NULL, 0);
+    }
+
+    // the others go back in front of the host queue, in order
+    while ((job = job_pop(&conn->inflight)) != NULL)
+    {
+        if (++job->retries > FETCH_MAX_RETRIES)
+        {
+            complete_job(engine, job, ERR_FETCH_CONNECTION_LOST, NULL, 0);
+        }
+        else
+        {
+            job_push(&retry, job);
+        }
+    }
+    if (retry.head != NULL)
+    {
+        retry.tail->next = host->jobs.head;
+        host->jobs.head = retry.head;
+        if (host->jobs.tail == NULL)
+        {
+            host->jobs.tail = retry.tail;
+        }
+        host->jobs.count += retry.count;
+    }
+
+    for (link = &host->conns; *link != conn; link = &(*link)->hostnext);
+    *link = conn->hostnext;
+    host->connections--;
+
+    if (conn->prev != NULL)
+    {
+        conn->prev->next = conn->next;
+    }
+    else
+    {
+        engine->conns = conn->next;
+    }
+    if (conn->next != NULL)
+    {
+        conn->next->prev = conn->prev;
+    }
+    engine->connections--;
+
+    if (conn->socket >= 0)
+    {
+        close(conn->socket);
+    }
+    free(conn->out);
+    free(conn->in);
+    free(conn);
+
+    schedule_host(host);
+    wake_waiting_hosts(engine);
+}
+
+/* the non-blocking connect finished. Return -1 when CONN is closed */
+static int handle_connected(struct fetchengine* engine, struct fetchconn* conn)
+{
+    int error = 0;
+    socklen_t length = sizeof(error);
+
+    if (getsockopt(conn->socket, SOL_SOCKET, SO_ERROR, &error, &length) < 0 || error != 0)
+    {
+        // try the next address of the host
+        epoll_ctl(engine->epoll, EPOLL_CTL_DEL, conn->socket, NULL);
+        close(conn->socket);
+        conn->socket = -1;
+        conn->address = conn->address->ai_next;
+        if (start_connect(engine, conn) < 0)
+        {
+            close_fetch_connection(engine, conn, ERR_FETCH_CANNOT_CONNECT);
+            return -1;
+        }
+        return 0;
+    }
+
+    conn->connected = 1;
+    conn->connectedat = trace_clock();
+    TRACE_EVENT(conn->socket, TRACE_CONNECT);
+    return 0;
+}
+
+/* send what CONN can take of its pending requests */
+static void flush_output(struct fetchengine* engine, struct fetchconn* conn)
+{
+    struct fetchjob* job = NULL;
+    ssize_t sent = 0;
+    u_int64_t now = 0;
+
+    while (conn->outsent < conn->outlength)
+    {
+        sent = send(conn->socket, conn->out + conn->outsent, conn->outlength - conn->outsent,
+                    MSG_DONTWAIT | MSG_NOSIGNAL);
+        if (sent <= 0)
+        {
+            return;
+        }
+        conn->outsent += sent;
+    }
+
+    // everything written, the requests in flight are all sent
+    now = trace_clock();
+    for (job = conn->inflight.head; job != NULL; job = job->next)
+    {
+        if (job->request->timings.sent == 0)
+        {
+            job->request->timings.connected = conn->connectedat;
+            job->request->timings.sent = now;
+        }
+    }
+    conn->outsent = conn->outlength = 0;
+    conn->deadline = now + (u_int64_t)engine->params.timeout * 1000000;
+    watch_connection(engine, conn, EPOLL_CTL_MOD);
+}
+
+/* read the responses available on CONN. Return -1 when CONN is closed */
+static int handle_readable(struct fetchengine* engine, struct fetchconn* conn)
+{
+    struct fetchjob* job = NULL;
+    ssize_t received = 0;
+    ssize_t length = 0;
+    byte* in = NULL;
+    struct httpresponse response;
+    byte* head = NULL;
+    int closed = 0;
+    int untilClose = 0;
+
+    while (1)
+    {
+        if (conn->inlength == conn->incapacity)
+        {
+            size_t capacity = conn->incapacity > 0 ? conn->incapacity * 2 : 16384;
+            if ((in = (byte*)realloc(conn->in, capacity)) == NULL)
+            {
+                close_fetch_connection(engine, conn, ERR_FETCH_INVALID_RESPONSE);
+                return -1;
+            }
+            conn->in = in;
+            conn->incapacity = capacity;
+        }
+
+        received = recv(conn->socket, conn->in + conn->inlength, 
+                        conn->incapacity - conn->inlength, MSG_DONTWAIT);
+        if (received <= 0)
+        {
+            closed = received == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+            break;
+        }
+
+        if (conn->inflight.head != NULL && conn->inflight.head->request->timings.firstbyte == 0)
+        {
+            conn->inflight.head->request->timings.firstbyte = trace_clock();
+        }
+        conn->inlength += received;
+    }
+
+    conn->deadline = trace_clock() + (u_int64_t)engine->params.timeout * 1000000;
+
+    while (conn->inflight.head != NULL && conn->inlength > 0)
+    {
+        length = frame_http_message(conn->in, conn->inlength, &untilClose);
+        if (length == 0 && closed && untilClose)
+        {
+            // the body ends with the connection
+            length = conn->inlength;
+        }
+        if (length < 0)
+        {
+            close_fetch_connection(engine, conn, ERR_FETCH_INVALID_RESPONSE);
+            return -1;
+        }
+        if (length == 0)
+        {
+            break;
+        }
+
+        // only the head is parsed, the body stays as received
+        head = (byte*)memmem(conn->in, length, "\r\n\r\n", 4);
+        if (parse_http_response(conn->in, head + 4 - conn->in, &response) < 0)
+        {
+            close_fetch_connection(engine, conn, ERR_FETCH_INVALID_RESPONSE);
+            return -1;
+        }
+
+        conn->responses++;
+        if (!response.keepalive || untilClose)
+        {
+            conn->closing = 1;
+        }
+        else if (engine->params.pipelinedepth > 1 && memcmp(conn->in, "HTTP/1.1", 8) == 0)
+        {
+            conn->pipelining = 1;
+        }
+
+        job = job_pop(&conn->inflight);
+        complete_job(engine, job, 0, conn->in, length);
+
+        memmove(conn->in, conn->in + length, conn->inlength - length);
+        conn->inlength -= length;
+
+        if (conn->inflight.head != NULL && conn->inlength > 0)
+        {
+            conn->inflight.head->request->timings.firstbyte = trace_clock();
+        }
+        if (conn->closing)
+        {
+            break;
+        }
+    }
+
+    if (closed || conn->closing)
+    {
+        close_fetch_connection(engine, conn, 0);
+        return -1;
+    }
+
+    if (conn->inflight.count == 0)
+    {
+        schedule_host(conn->host);
+        if (conn->inflight.count == 0)
+        {
+            // nothing left for this host, free the slot for the others
+            close_fetch_connection(engine, conn, 0);
+            return -1;
+        }
+    }
+    else if (conn->pipelining)
+    {
+        schedule_host(conn->host);
+    }
+
+    return 0;
+}
+
+static void check_timeouts(struct fetchengine* engine)
+{
+    struct fetchconn* conn = engine->conns;
+    struct fetchconn* next = NULL;
+    u_int64_t now = trace_clock();
+
+    for (; conn != NULL; conn = next)
+    {
+        next = conn->next;
+        if (conn->deadline < now)
+        {
+            print_info("Request to %s timed out", conn->host->hostname);
+            close_fetch_connection(engine, conn, ERR_FETCH_TIMEOUT);
+            next = engine->conns;
+            now = trace_clock();
+        }
+    }
+}
+
+struct fetchengine* create_fetch_engine(struct fetchparams* params)
+{
+    struct fetchengine* engine = NULL;
+
+    if (params->maxconnections < 1 || params->maxperhost < 1 || params->pipelinedepth < 1
+        || params->timeout < 1 || params->callback == NULL)
+    {
+        return NULL;
+    }
+
+    if ((engine = (struct fetchengine*)calloc(1, sizeof(struct fetchengine))) == NULL)
+    {
+        return NULL;
+    }
+
+    engine->params = *params;
+    engine->epoll = epoll_create1(EPOLL_CLOEXEC);
+    engine->resolver = create_resolver(FETCH_RESOLVER_THREADS);
+    if (engine->epoll < 0 || engine->resolver == NULL)
+    {
+        print_error("Cannot create the fetch engine");
+        destroy_fetch_engine(engine);
+        return NULL;
+    }
+
+    {
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = NULL;
+        epoll_ctl(engine->epoll, EPOLL_CTL_ADD, resolver_fd(engine->resolver), &event);
+    }
+
+    return engine;
+}
+
+int queue_fetch(struct fetchengine* engine, struct fetchrequest* request)
+{
+    struct fetchhost* host = NULL;
+    struct fetchjob* job = NULL;
+
+    if ((host = find_host(engine, request)) == NULL
+        || (job = (struct fetchjob*)calloc(1, sizeof(struct fetchjob))) == NULL)
+    {
+        return -1;
+    }
+
+    memset(&request->timings, 0, sizeof(request->timings));
+    request->timings.queued = trace_clock();
+    request->status = 0;
+    request->error = 0;
+    request->reused = 0;
+    job->request = request;
+    job_push(&host->jobs, job);
+    engine->outstanding++;
+
+    // the loop sends it, unless a slot is free right now
+    if (host->jobs.count == 1 && !host->waiting)
+    {
+        schedule_host(host);
+    }
+    return 0;
+}
+
+int run_fetch_engine(struct fetchengine* engine)
+{
+    struct epoll_event events[FETCH_EVENTS];
+    struct fetchconn* conn = NULL;
+    u_int64_t nextCheck = trace_clock() + FETCH_TICK * 1000000ULL;
+    int completed = engine->completed;
+    int count, i;
+
+    while (engine->outstanding > 0)
+    {
+        count = epoll_wait(engine->epoll, events, FETCH_EVENTS, FETCH_TICK);
+        for (i = 0; i < count; i++)
+        {
+            if ((conn = (struct fetchconn*)events[i].data.ptr) == NULL)
+            {
+                dispatch_resolutions(engine->resolver);
+                continue;
+            }
+
+            if (!conn->connected)
+            {
+                if (handle_connected(engine, conn) < 0 || !conn->connected)
+                {
+                    continue;
+                }
+            }
+            if (events[i].events & EPOLLOUT)
+            {
+                flush_output(engine, conn);
+            }
+            if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+            {
+                handle_readable(engine, conn);
+            }
+        }
+
+        if (trace_clock() >= nextCheck)
+        {
+            check_timeouts(engine);
+            nextCheck = trace_clock() + FETCH_TICK * 1000000ULL;
+        }
+    }
+
+    return engine->completed - completed;
+}
+
+void destroy_fetch_engine(struct fetchengine* engine)
+{
+    struct fetchhost* host = NULL;
+    struct fetchconn* conn = NULL;
+    struct fetchjob* job = NULL;
+    int bucket;
+
+    if (engine == NULL)
+    {
+        return;
+    }
+
+    // the lookups still running are dropped without their callback
+    destroy_resolver(engine->resolver);
+
+    // the requests left are released without calling back
+    while ((conn = engine->conns) != NULL)
+    {
+        engine->conns = conn->next;
+        while ((job = job_pop(&conn->inflight)) != NULL)
+        {
+            free(job);
+        }
+        if (conn->socket >= 0)
+        {
+            close(conn->socket);
+        }
+        free(conn->out);
+        free(conn->in);
+        free(conn);
+    }
+
+    for (bucket = 0; bucket < FETCH_HOST_BUCKETS; bucket++)
+    {
+        while ((host = engine->buckets[bucket]) != NULL)
+        {
+            engine->buckets[bucket] = host->next;
+            while ((job = job_pop(&host->jobs)) != NULL)
+            {
+                free(job);
+            }
+            if (host->addrinfo != NULL)
+            {
+                free_addrinfo_copy(host->addrinfo);
+            }
+            free(host->hostname);
+            free(host->port);
+            free(host);
+        }
+    }
+
+    if (engine->epoll >= 0)
+    {
+        close(engine->epoll);
+    }
+    free(engine);
+}
@@ -0,0 +1,103 @@
+/*  Prototype for the concurrent fetch engine
+
+    This prototype defines an engine fetching many HTTP resources at the
+    same time from a single thread. The requests are queued per host and
+    sent over a bounded number of non-blocking connections driven by an
+    epoll loop. The connections of a host are kept alive between its
+    requests and, once the host answered in HTTP/1.1 without closing,
+    several requests are pipelined on each of them.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef FETCH_H_
+#define FETCH_H_
+
+#include <sys/types.h>
+#include "client.h"
+
+/* Time of each step of a request, in nanoseconds of the monotonic clock
+   (see trace_clock), 0 when the step did not happen */
+struct fetchtimings
+  {
+    u_int64_t queued;       // queue_fetch called
+    u_int64_t resolved;     // address of the host known
+    u_int64_t connected;    // connection carrying the request established
+    u_int64_t sent;         // last byte of the request written
+    u_int64_t firstbyte;    // first byte of the response received
+    u_int64_t completed;    // response complete or request failed
+  };
+
+/* One GET request. The strings are not copied and must stay valid until
+   the request completes */
+struct fetchrequest
+  {
+    char* hostname;
+    char* port;
+    char* path;
+    char* headers;          // extra header lines ending with \r\n, or NULL
+    void* context;          // free for the caller to use
+    int status;             // HTTP status of the response, 0 on failure
+    int error;              // 0, otherwise -1 host not resolved, -2 cannot
+                            // connect, -3 invalid response, -4 timeout,
+                            // -5 connection lost too many times
+    int reused;             // sent on an already established connection
+    struct fetchtimings timings;
+  };
+
+/* Called in the thread running the engine when a request completes or
+   fails. __response holds the whole HTTP message, headers included, and
+   is only valid during the call */
+typedef void (*fetch_callback)(struct fetchrequest* __request, 
+                               const byte* __response, size_t __length);
+
+/* Limits of the engine */
+struct fetchparams
+  {
+    int maxconnections;     // connections open at the same time
+    int maxperhost;         // connections open to the same host:port
+    int pipelinedepth;      // requests in flight per connection, 1 to
+                            // never pipeline
+    int timeout;            // milliseconds without progress on a
+                            // connection before its requests fail
+    fetch_callback callback;
+  };
+
+/* Engine, opaque */
+struct fetchengine;
+
+/* Create an engine, NULL on failure */
+extern struct fetchengine* create_fetch_engine(struct fetchparams* __params);
+
+/* Queue __request, sent by the next run_fetch_engine. Return 0 on
+   success, otherwise negative int */
+extern int queue_fetch(struct fetchengine* __engine, struct fetchrequest* __request);
+
+/* Run the event loop until every queued request completed or failed.
+   Requests can be queued from the callback. Return the number of
+   requests completed with a response */
+extern int run_fetch_engine(struct fetchengine* __engine);
+
+/* Close the connections and release the engine */
+extern void destroy_fetch_engine(struct fetchengine* __engine);
+
+#endif
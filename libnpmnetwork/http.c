@@ -0,0 +1,440 @@
+/*  Implementation of the HTTP/1.1 client
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include "http.h"
+#include "internlog.h"
+
+/* error codes, following the ones of the client */
+const int ERR_HTTP_INVALID_RESPONSE = -10;
+const int ERR_HTTP_CANNOT_SEND     = -11;
+
+/* times a request is sent again when its connection is lost */
+#define HTTP_MAX_RETRIES 2
+
+struct httpclient
+  {
+    struct connpool* pool;
+  };
+
+/* GET, HEAD, PUT, DELETE, OPTIONS and TRACE can be sent twice, RFC 7231 */
+static int is_idempotent(const char* method)
+{
+    return strcmp(method, "GET") == 0 || strcmp(method, "HEAD") == 0
+           || strcmp(method, "PUT") == 0 || strcmp(method, "DELETE") == 0
+           || strcmp(method, "OPTIONS") == 0 || strcmp(method, "TRACE") == 0;
+}
+
+/* move the data of the chunks of BODY over their size lines. Return the
+   decoded length, otherwise negative int */
+static ssize_t decode_chunked_body(byte* body, size_t length)
+{
+    byte* source = body;
+    byte* target = body;
+    byte* end = body + length;
+    ssize_t offset = 0;
+    size_t chunk = 0;
+
+    while ((offset = parse_chunk_size(source, end - source, &chunk)) > 0)
+    {
+        source += offset;
+
+        // the trailers, if any, are left behind
+        if (chunk == 0)
+        {
+            return target - body;
+        }
+
+        if ((size_t)(end - source) < 2 || chunk > (size_t)(end - source) - 2
+            || source[chunk] != '\r' || source[chunk + 1] != '\n')
+        {
+            return ERR_HTTP_INVALID_RESPONSE;
+        }
+        memmove(target, source, chunk);
+        target += chunk;
+        source += chunk + 2;
+    }
+
+    return ERR_HTTP_INVALID_RESPONSE;
+}
+
+int parse_http_response(byte* data, size_t length, struct httpresponse* response)
+{
+    char* line = (char*)data;
+    char* end = (char*)data + length;
+    char* next = NULL;
+    char* colon = NULL;
+    char* value = NULL;
+    char* valueEnd = NULL;
+    struct httpheader* header = NULL;
+    int chunked = 0;
+    int connection = 0;   // 1 close, 2 keep-alive
+    ssize_t decoded = 0;
+
+    memset(response, 0, sizeof(struct httpresponse));
+    response->length = length;
+
+    // "HTTP/1.1 200 OK"
+    if ((next = memmem(line, end - line, "\r\n", 2)) == NULL || next - line < 12
+        || memcmp(line, "HTTP/1.", 7) != 0 || line[8] != ' ')
+    {
+        return ERR_HTTP_INVALID_RESPONSE;
+    }
+    response->minor = line[7] - '0';
+    response->status = atoi(line + 9);
+    response->reason = next - line > 13 ? line + 13 : next;
+    response->reasonlength = next - response->reason;
+
+    for (line = next + 2; (next = memmem(line, end - line, "\r\n", 2)) != NULL; line = next + 2)
+    {
+        if (next == line)
+        {
+            break;
+        }
+        if ((colon = memchr(line, ':', next - line)) == NULL)
+        {
+            return ERR_HTTP_INVALID_RESPONSE;
+        }
+
+        // the value without the spaces around it
+        for (value = colon + 1; value < next && (*value == ' ' || *value == '\t'); value++);
+        for (valueEnd = next; valueEnd > value && (valueEnd[-1] == ' ' || valueEnd[-1] == '\t'); 
+             valueEnd--);
+
+        if (colon - line == 17 && strncasecmp(line, "Transfer-Encoding", 17) == 0)
+        {
+            chunked = is_chunked_encoding(value, valueEnd - value);
+        }
+        else if (colon - line == 10 && strncasecmp(line, "Connection", 10) == 0)
+        {
+            connection = strncasecmp(value, "close", 5) == 0 ? 1 
+                         : strncasecmp(value, "keep-alive", 10) == 0 ? 2 : 0;
+        }
+
+        if (response->headercount < HTTP_MAX_HEADERS)
+        {
+            header = &response->headers[response->headercount++];
+            header->name = line;
+            header->namelength = colon - line;
+            header->value = value;
+            header->valuelength = valueEnd - value;
+        }
+    }
+
+    if (next == NULL)
+    {
+        return ERR_HTTP_INVALID_RESPONSE;
+    }
+
+    response->body = (byte*)next + 2;
+    response->bodylength = end - (next + 2);
+    response->keepalive = response->minor >= 1 ? connection != 1 : connection == 2;
+
+    if (chunked && response->bodylength > 0)
+    {
+        if ((decoded = decode_chunked_body(response->body, response->bodylength)) < 0)
+        {
+            return ERR_HTTP_INVALID_RESPONSE;
+        }
+        response->bodylength = decoded;
+    }
+
+    return 0;
+}
+
+const char* find_response_header(struct httpresponse* response, const char* name, size_t* length)
+{
+    size_t nameLength = strlen(name);
+    int i;
+
+    for (i = 0; i < response->headercount; i++)
+    {
+        if (response->headers[i].namelength == nameLength
+            && strncasecmp(response->headers[i].name, name, nameLength) == 0)
+        {
+            *length = response->headers[i].valuelength;
+            return response->headers[i].value;
+        }
+    }
+
+    return NULL;
+}
+
+/* write the head of REQUEST at the end of OUT, growing it. Return 0,
+   otherwise negative int */
+static int format_request(struct clientparams* params, struct httprequest* request,
+                          char** out, size_t* length, size_t* capacity)
+{
+    const char* format = "%s %s HTTP/1.1\r\nHost: %s%s%s\r\n%s%s\r\n";
+    char contentLength[48] = "";
+    int needed = 0;
+    char* grown = NULL;
+    int defaultPort = strcmp(params->port, "80") == 0;
+
+    if (request->bodylength > 0 || strcmp(request->method, "POST") == 0 
+        || strcmp(request->method, "PUT") == 0)
+    {
+        snprintf(contentLength, sizeof(contentLength), "Content-Length: %zu\r\n", 
+                 request->bodylength);
+    }
+
+    needed = snprintf(NULL, 0, format, request->method, request->path, params->hostname,
+                      defaultPort ? "" : ":", defaultPort ? "" : params->port,
+                      contentLength, request->headers != NULL ? request->headers : "");
+
+    if (*length + needed + 1 > *capacity)
+    {
+        if ((grown = (char*)realloc(*out, *length + needed + 1024)) == NULL)
+        {
+            return ERR_HTTP_CANNOT_SEND;
+        }
+        *out = grown;
+        *capacity = *length + needed + 1024;
+    }
+
+    snprintf(*out + *length, needed + 1, format, request->method, request->path, params->hostname,
+             defaultPort ? "" : ":", defaultPort ? "" : params->port,
+             contentLength, request->headers != NULL ? request->headers : "");
+    *length += needed;
+    return 0;
+}
+
+/* receive the final response of a request, skipping the interim 1xx
+   ones, and parse it */
+static int receive_response(int socket, struct recvbuffer* buffer, int head,
+                            struct httpresponse* response)
+{
+    ssize_t length = 0;
+
+    while (1)
+    {
+        // the response to HEAD has no body whatever its headers say
+        length = head ? receive_until(socket, buffer, (const byte*)"\r\n\r\n", 4, 0)
+                      : receive_http_message(socket, buffer, 0);
+        if (length <= 0)
+        {
+            return length < 0 ? (int)length : ERR_HTTP_INVALID_RESPONSE;
+        }
+
+        if (parse_http_response(buffer->data, length, response) < 0)
+        {
+            print_error("Invalid HTTP response");
+            return ERR_HTTP_INVALID_RESPONSE;
+        }
+
+        if (response->status >= 200 || response->status < 100 || response->status == 101)
+        {
+            return 0;
+        }
+        consume_receive_buffer(buffer, length);
+    }
+}
+
+struct httpclient* create_http_client(int maxPerHost, int idleTimeout)
+{
+    struct httpclient* client = NULL;
+
+    if ((client = (struct httpclient*)calloc(1, sizeof(struct httpclient))) == NULL)
+    {
+        return NULL;
+    }
+
+    if ((client->pool = create_connection_pool(maxPerHost, idleTimeout)) == NULL)
+    {
+        free(client);
+        return NULL;
+    }
+
+    return client;
+}
+
+int http_request(struct httpclient* client, struct clientparams* params,
+                 struct httprequest* request, struct recvbuffer* buffer,
+                 struct httpresponse* response)
+{
+    char* head = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    int attempts = is_idempotent(request->method) ? HTTP_MAX_RETRIES + 1 : 1;
+    int socket = 0;
+    int result = 0;
+
+    if ((result = format_request(params, request, &head, &length, &capacity)) < 0)
+    {
+        return result;
+    }
+
+    while (attempts-- > 0)
+    {
+        if ((socket = acquire_connection(client->pool, params)) < 0)
+        {
+            result = socket;
+            break;
+        }
+
+        buffer->length = 0;
+        if ((result = send_bulk_to_host(socket, (byte*)head, length, 
+                                        (byte*)request->body, request->bodylength)) == 0
+            && (result = receive_response(socket, buffer, strcmp(request->method, "HEAD") == 0,
+                                          response)) == 0)
+        {
+            release_connection(client->pool, params, socket, response->keepalive);
+            free(head);
+            return response->status;
+        }
+
+        release_connection(client->pool, params, socket, 0);
+
+        // a connection closed by the host while idle, try a new one
+        if (buffer->length > 0)
+        {
+            break;
+        }
+    }
+
+    free(head);
+    return result;
+}
+
+int http_pipeline(struct httpclient* client, struct clientparams* params,
+                  struct httprequest* requests, int count, int depth,
+                  http_callback callback, void* context)
+{
+    struct recvbuffer buffer;
+    struct httpresponse response;
+    char* out = NULL;
+    size_t length = 0;
+    size_t capacity = 0;
+    int socket = -1;
+    int sent = 0;        // next request to send
+    int done = 0;        // next response to receive
+    int failures = 0;
+    int result = 0;
+    int stop = 0;
+
+    init_receive_buffer(&buffer, NULL, 0, 0);
+
+    while (done < count && !stop)
+    {
+        if (socket < 0)
+        {
+            if ((socket = acquire_connection(client->pool, params)) < 0)
+            {
+                result = socket;
+                break;
+            }
+            buffer.length = 0;
+            sent = done;
+        }
+
+        // a request is added behind others only if all of them can be sent
+        // again, should the connection close before their responses
+        length = 0;
+        while (sent < count && sent - done < depth
+               && (sent == done || (is_idempotent(requests[sent].method)
+                                    && is_idempotent(requests[done].method))))
+        {
+            if ((result = format_request(params, &requests[sent], &out, &length, &capacity)) < 0)
+            {
+                break;
+            }
+            if (requests[sent].bodylength > 0)
+            {
+                if (length + requests[sent].bodylength > capacity)
+                {
+                    char* grown = (char*)realloc(out, length + requests[sent].bodylength + 1024);
+                    if (grown == NULL)
+                    {
+                        result = ERR_HTTP_CANNOT_SEND;
+                        break;
+                    }
+                    out = grown;
+                    capacity = length + requests[sent].bodylength + 1024;
+                }
+                memcpy(out + length, requests[sent].body, requests[sent].bodylength);
+                length += requests[sent].bodylength;
+            }
+            sent++;
+        }
+        if (result < 0)
+        {
+            break;
+        }
+
+        // all the requests of the window leave in one call
+        if (length > 0 && send_data_to_host(socket, (byte*)out, length) < 0)
+        {
+            result = ERR_HTTP_CANNOT_SEND;
+        }
+        else
+        {
+            result = receive_response(socket, &buffer, 
+                                      strcmp(requests[done].method, "HEAD") == 0, &response);
+        }
+
+        if (result < 0)
+        {
+            release_connection(client->pool, params, socket, 0);
+            socket = -1;
+            if (buffer.length > 0 || ++failures > HTTP_MAX_RETRIES
+                || !is_idempotent(requests[done].method))
+            {
+                break;
+            }
+            result = 0;
+            continue;
+        }
+
+        failures = 0;
+        stop = callback(&requests[done], &response, context);
+        consume_receive_buffer(&buffer, response.length);
+        done++;
+
+        // the requests sent after this one are lost with the connection
+        if (!response.keepalive)
+        {
+            release_connection(client->pool, params, socket, 0);
+            socket = -1;
+        }
+    }
+
+    if (socket >= 0)
+    {
+        release_connection(client->pool, params, socket, sent == done);
+    }
+
+    free_receive_buffer(&buffer);
+    free(out);
+    return result < 0 && done == 0 ? result : done;
+}
+
+void destroy_http_client(struct httpclient* client)
+{
+    destroy_connection_pool(client->pool);
+    free(client);
+}
@@ -0,0 +1,118 @@
+/*  Prototype for the HTTP/1.1 client
+
+    This prototype defines a client sending HTTP/1.1 requests over the
+    connections of a pool, kept alive between the requests. Responses are
+    parsed where they were received: the status, headers and body point
+    into the receive buffer and chunked bodies are decoded in place.
+    Idempotent requests can be pipelined on one connection.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef HTTP_H_
+#define HTTP_H_
+
+#include <sys/types.h>
+#include "client.h"
+
+/* headers kept by the parser, the next ones are skipped */
+#define HTTP_MAX_HEADERS 64
+
+/* One header, pointing into the receive buffer, not null terminated */
+struct httpheader
+  {
+    const char* name;
+    size_t namelength;
+    const char* value;
+    size_t valuelength;
+  };
+
+/* A response parsed in place, valid as long as the receive buffer is */
+struct httpresponse
+  {
+    int status;
+    int minor;              // 1 for HTTP/1.1, 0 for HTTP/1.0
+    const char* reason;
+    size_t reasonlength;
+    struct httpheader headers[HTTP_MAX_HEADERS];
+    int headercount;
+    byte* body;             // decoded when the body was chunked
+    size_t bodylength;
+    size_t length;          // bytes taken by the message in the buffer
+    int keepalive;          // the connection can carry another request
+  };
+
+/* A request. __headers holds extra header lines ending with \r\n, or
+   NULL. The Host and Content-Length headers are added */
+struct httprequest
+  {
+    const char* method;
+    const char* path;
+    const char* headers;
+    const byte* body;
+    size_t bodylength;
+  };
+
+/* Called for each response of http_pipeline, in the order of the
+   requests. Return non zero to stop */
+typedef int (*http_callback)(struct httprequest* __request, struct httpresponse* __response,
+                             void* __context);
+
+/* Client, opaque */
+struct httpclient;
+
+/* Parse the complete HTTP message of __length bytes at __data, as framed
+   by http_message_length or receive_http_message. A chunked body is
+   decoded in place. Return 0, otherwise negative int if the message is
+   invalid */
+extern int parse_http_response(byte* __data, size_t __length, struct httpresponse* __response);
+
+/* Value of the header __name of __response, NULL if absent. __length
+   receives the length of the value */
+extern const char* find_response_header(struct httpresponse* __response, const char* __name,
+                                        size_t* __length);
+
+/* Create a client keeping at most __maxPerHost connections to each host,
+   closed after __idleTimeout seconds unused. Return NULL on failure */
+extern struct httpclient* create_http_client(int __maxPerHost, int __idleTimeout);
+
+/* Send __request to the host of __params and receive its response in
+   __buffer, emptied first. An idempotent request failing on a reused
+   connection before any byte of the response is sent again on a new
+   one. Return the HTTP status, otherwise negative int */
+extern int http_request(struct httpclient* __client, struct clientparams* __params,
+                        struct httprequest* __request, struct recvbuffer* __buffer,
+                        struct httpresponse* __response);
+
+/* Send the __count requests to the host of __params, up to __depth of
+   them in flight on one connection. Only idempotent requests are
+   pipelined, the others wait for the responses before them. __callback
+   receives each response. Return the number of responses received,
+   otherwise negative int */
+extern int http_pipeline(struct httpclient* __client, struct clientparams* __params,
+                         struct httprequest* __requests, int __count, int __depth,
+                         http_callback __callback, void* __context);
+
+/* Close the connections and release the client */
+extern void destroy_http_client(struct httpclient* __client);
+
+#endif
@@ -25,32 +25,49 @@
 
 #include <stdio.h>
 #include <stdarg.h>
+#include "logger.h"
 #include "internlog.h"
 
 int g_logEnabled = 0;
 
+/* the messages of the library go through the logger of libnpmtoolkit,
+   they follow its level, output and asynchronous mode */
 void print_log(FILE* f, char* format, va_list args)
 {
-    if (g_logEnabled != 0) 
+    LogLevel level = f == stderr ? LOGGER_ERROR : LOGGER_INFO;
+
+    if (g_logEnabled != 0 && level <= g_logPriority)
     {
-        vfprintf(f, format, args);
-        fprintf(f, "\n");
-    }  
+        vlogmsg(level, format, args);
+    }
 }
 
 void print_info(char* format, ...)
 {
     va_list args;
+
+    // checked before va_start, the accept path pays a single branch
+    if (g_logEnabled == 0 || LOGGER_INFO > g_logPriority)
+    {
+        return;
+    }
+
     va_start(args, format);
-    print_log(stdout, format, args);
+    vlogmsg(LOGGER_INFO, format, args);
     va_end(args);
 } 
 
 void print_error(char* format, ...)
 {
     va_list args;
+
+    if (g_logEnabled == 0 || LOGGER_ERROR > g_logPriority)
+    {
+        return;
+    }
+
     va_start(args, format);
-    print_log(stderr, format, args);
+    vlogmsg(LOGGER_ERROR, format, args);
     va_end(args);
 } 
 
@@ -29,15 +29,17 @@
 #include <stdio.h>
 #include <stdarg.h>
 
-/* Print log message on the specified FILE descriptor */
+/* Log a message through the logger of libnpmtoolkit, at the error level
+   when f is stderr, at the info level otherwise */
 void print_log(FILE* f, char* format, va_list args);
 
-/* Print log message on the stdout file descriptor */
+/* Log a message at the info level */
 void print_info(char* format, ...);
 
-/* Print log message on the stderr file descriptor */
+/* Log a message at the error level */
 void print_error(char* format, ...);
 
+/* Let the library log its messages, off by default */
 void enable_log(int enabled);
 
 #endif
@@ -0,0 +1,282 @@
+/*  Implementation of the asynchronous resolver
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/eventfd.h>
+#include "resolver.h"
+#include "dnscache.h"
+#include "client.h"
+#include "internlog.h"
+
+/* error code */
+const int ERR_CANNOT_QUEUE_LOOKUP = -1;
+
+/* one lookup, queued then completed */
+struct resolverequest
+  {
+    struct clientparams params;
+    resolve_callback callback;
+    void* ctx;
+    int error;
+    struct addrinfo* result;
+    struct resolverequest* next;
+  };
+
+/* FIFO of requests */
+struct requestqueue
+  {
+    struct resolverequest* head;
+    struct resolverequest* tail;
+  };
+
+struct resolver
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    struct requestqueue pending;
+    struct requestqueue completed;
+    int eventfd;
+    int stopped;
+    int threads;
+    pthread_t* workers;
+  };
+
+static void queue_push(struct requestqueue* queue, struct resolverequest* request)
+{
+    request->next = NULL;
+    if (queue->tail != NULL)
+    {
+        queue->tail->next = request;
+    }
+    else
+    {
+        queue->head = request;
+    }
+    queue->tail = request;
+}
+
+static struct resolverequest* queue_pop_all(struct requestqueue* queue)
+{
+    struct resolverequest* head = queue->head;
+    queue->head = queue->tail = NULL;
+    return head;
+}
+
+static void free_request(struct resolverequest* request)
+{
+    if (request->result != NULL)
+    {
+        free_addrinfo_copy(request->result);
+    }
+    free(request->params.hostname);
+    free(request->params.port);
+    free(request);
+}
+
+/* body of the threads running the lookups */
+static void* run_resolver(void* arg)
+{
+    struct resolver* resolver = (struct resolver*)arg;
+    struct resolverequest* request = NULL;
+    u_int64_t one = 1;
+
+    pthread_mutex_lock(&resolver->lock);
+    while (1)
+    {
+        while (resolver->pending.head == NULL && resolver->stopped == 0)
+        {
+            pthread_cond_wait(&resolver->wakeup, &resolver->lock);
+        }
+        if (resolver->stopped)
+        {
+            break;
+        }
+
+        request = resolver->pending.head;
+        resolver->pending.head = request->next;
+        if (resolver->pending.head == NULL)
+        {
+            resolver->pending.tail = NULL;
+        }
+        pthread_mutex_unlock(&resolver->lock);
+
+        // without the cache enabled, this is a plain lookup
+        request->error = resolve_with_cache(&request->params, &request->result);
+
+        pthread_mutex_lock(&resolver->lock);
+        queue_push(&resolver->completed, request);
+        if (write(resolver->eventfd, &one, sizeof(one)) < 0)
+        {
+            print_error("Cannot signal a completed lookup");
+        }
+    }
+    pthread_mutex_unlock(&resolver->lock);
+
+    return NULL;
+}
+
+struct resolver* create_resolver(int threads)
+{
+    struct resolver* resolver = NULL;
+    int i;
+
+    if (threads < 1 || (resolver = (struct resolver*)calloc(1, sizeof(struct resolver))) == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_mutex_init(&resolver->lock, NULL);
+    pthread_cond_init(&resolver->wakeup, NULL);
+    resolver->workers = (pthread_t*)calloc(threads, sizeof(pthread_t));
+    resolver->eventfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (resolver->workers == NULL || resolver->eventfd < 0)
+    {
+        print_error("Cannot allocate the resolver");
+        destroy_resolver(resolver);
+        return NULL;
+    }
+
+    for (i = 0; i < threads; i++)
+    {
+        if (pthread_create(&resolver->workers[i], NULL, run_resolver, resolver) != 0)
+        {
+            print_error("Cannot start the resolver threads");
+            destroy_resolver(resolver);
+            return NULL;
+        }
+        resolver->threads++;
+    }
+
+    return resolver;
+}
+
+int resolve_async(struct resolver* resolver, struct clientparams* params,
+                  resolve_callback callback, void* ctx)
+{
+    struct resolverequest* request = NULL;
+
+    if ((request = (struct resolverequest*)calloc(1, sizeof(struct resolverequest))) == NULL)
+    {
+        return ERR_CANNOT_QUEUE_LOOKUP;
+    }
+
+    request->params.hostname = strdup(params->hostname);
+    request->params.port = strdup(params->port);
+    request->params.family = params->family;
+    request->params.type = params->type;
+    request->callback = callback;
+    request->ctx = ctx;
+    if (request->params.hostname == NULL || request->params.port == NULL)
+    {
+        free_request(request);
+        return ERR_CANNOT_QUEUE_LOOKUP;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    queue_push(&resolver->pending, request);
+    pthread_cond_signal(&resolver->wakeup);
+    pthread_mutex_unlock(&resolver->lock);
+
+    return 0;
+}
+
+int resolver_fd(struct resolver* resolver)
+{
+    return resolver->eventfd;
+}
+
+int dispatch_resolutions(struct resolver* resolver)
+{
+    struct resolverequest* request = NULL;
+    struct resolverequest* next = NULL;
+    u_int64_t count = 0;
+    int dispatched = 0;
+
+    pthread_mutex_lock(&resolver->lock);
+    if (read(resolver->eventfd, &count, sizeof(count)) < 0)
+    {
+        count = 0;
+    }
+    request = queue_pop_all(&resolver->completed);
+    pthread_mutex_unlock(&resolver->lock);
+
+    // run the callbacks without the lock, they may queue new lookups
+    for (; request != NULL; request = next)
+    {
+        next = request->next;
+        request->callback(request->error, request->result, request->ctx);
+        request->result = NULL;
+        free_request(request);
+        dispatched++;
+    }
+
+    return dispatched;
+}
+
+void destroy_resolver(struct resolver* resolver)
+{
+    struct resolverequest* request = NULL;
+    struct resolverequest* next = NULL;
+    int i;
+
+    if (resolver == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&resolver->lock);
+    resolver->stopped = 1;
+    pthread_cond_broadcast(&resolver->wakeup);
+    pthread_mutex_unlock(&resolver->lock);
+
+    // a thread in the middle of a lookup finishes it first
+    for (i = 0; i < resolver->threads; i++)
+    {
+        pthread_join(resolver->workers[i], NULL);
+    }
+
+    for (request = queue_pop_all(&resolver->pending); request != NULL; request = next)
+    {
+        next = request->next;
+        free_request(request);
+    }
+    for (request = queue_pop_all(&resolver->completed); request != NULL; request = next)
+    {
+        next = request->next;
+        free_request(request);
+    }
+
+    if (resolver->eventfd >= 0)
+    {
+        close(resolver->eventfd);
+    }
+    pthread_mutex_destroy(&resolver->lock);
+    pthread_cond_destroy(&resolver->wakeup);
+    free(resolver->workers);
+    free(resolver);
+}
@@ -0,0 +1,69 @@
+/*  Prototype for the asynchronous resolver
+
+    This prototype defines a resolver running the lookups of host names
+    on a pool of threads so the thread driving an event loop never waits
+    on getaddrinfo. The completion of a lookup is signaled on a file
+    descriptor that the event loop polls with its sockets, the callbacks
+    are then run by the event loop thread itself.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef RESOLVER_H_
+#define RESOLVER_H_
+
+#include <netdb.h>
+
+struct clientparams;
+
+/* Resolver, opaque */
+struct resolver;
+
+/* Called when a lookup completes. __error is 0 on success, otherwise the
+   getaddrinfo error. __addrinfo belongs to the callback and is released
+   with free_addrinfo_copy */
+typedef void (*resolve_callback)(int __error, struct addrinfo* __addrinfo, void* __ctx);
+
+/* Create a resolver running __threads lookups at the same time. Return
+   NULL on failure */
+extern struct resolver* create_resolver(int __threads);
+
+/* Queue the lookup of the host of __params, the strings are copied.
+   __callback is run with __ctx by dispatch_resolutions once it is done.
+   The lookups go through the DNS cache when it is enabled. Return 0 on
+   success, otherwise negative int */
+extern int resolve_async(struct resolver* __resolver, struct clientparams* __params,
+                         resolve_callback __callback, void* __ctx);
+
+/* File descriptor readable when lookups are completed, to add to the
+   poll or epoll set of the event loop */
+extern int resolver_fd(struct resolver* __resolver);
+
+/* Run the callbacks of the completed lookups in the calling thread.
+   Return the number of callbacks run */
+extern int dispatch_resolutions(struct resolver* __resolver);
+
+/* Stop the threads and release the resolver. The callbacks of the
+   lookups not dispatched yet are not run */
+extern void destroy_resolver(struct resolver* __resolver);
+
+#endif
@@ -0,0 +1,568 @@
+/*  Implementation of the encrypted channel
+
+    A record is a 4 bytes big endian length, the encrypted payload and a
+    16 bytes tag. The tag is the truncated HMAC-SHA256 of the sequence
+    number of the record, the length and the encrypted payload. The CTR
+    counter of a record is the 4 bytes prefix of its direction, followed
+    by the 8 bytes sequence number and a 4 bytes block counter, so a
+    counter is never used twice with the same key.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/random.h>
+#include "../libnpmcrypto/aes.h"
+#include "../libnpmcrypto/hmac.h"
+#include "../libnpmcrypto/prng.h"
+#include "secure.h"
+
+/* error code */
+const int ERR_SECURE_CANNOT_SEND      = -1;
+const int ERR_SECURE_CANNOT_RECEIVE   = -2;
+const int ERR_SECURE_INVALID_RECORD   = -3;
+const int ERR_SECURE_SEQUENCE_EXHAUSTED = -4;
+
+/* handshake constants */
+#define SECURE_MAGIC        "NPMS"
+#define SECURE_VERSION      1
+#define SECURE_NONCE_SIZE   32
+#define SECURE_HELLO_SIZE   (4 + 1 + SECURE_NONCE_SIZE)
+
+/* record constants */
+#define SECURE_HEADER_SIZE  4
+#define SECURE_TAG_SIZE     16
+
+/* records sent per call to sendmsg, 3 iovec per record */
+#define SECURE_BATCH_SIZE   64
+
+/* keys and sequence number of one direction */
+struct securedirection
+  {
+    aes_key cipher;
+    byte mackey[SHA256_HASH_SIZE];
+    byte prefix[4];
+    u_int64_t sequence;
+  };
+
+struct securechannel
+  {
+    int socket;
+    struct securedirection out;
+    struct securedirection in;
+    size_t pending;     // bytes received after the last complete record
+    size_t consumed;    // bytes of the buffer holding returned records
+  };
+
+/* read exactly LEN bytes, waiting on a non-blocking socket */
+static ssize_t read_exact(int socket, byte* buffer, size_t len)
+{
+    struct pollfd pfd;
+    size_t total = 0;
+    ssize_t received = 0;
+
+    while (total < len)
+    {
+        if ((received = recv(socket, buffer + total, len - total, 0)) > 0)
+        {
+            total += received;
+            continue;
+        }
+
+        if (received == 0)
+        {
+            return total;
+        }
+
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            pfd.fd = socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, -1);
+        }
+        else if (errno != EINTR)
+        {
+            return ERR_SECURE_CANNOT_RECEIVE;
+        }
+    }
+
+    return total;
+}
+
+/* send the whole iovec array, resuming after partial writes */
+static int send_all(int socket, struct iovec* iov, int count)
+{
+    struct msghdr msg;
+    struct pollfd pfd;
+    ssize_t sent = 0;
+
+    while (count > 0)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+
+        if ((sent = sendmsg(socket, &msg, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                pfd.fd = socket;
+                pfd.events = POLLOUT;
+                pfd.revents = 0;
+                poll(&pfd, 1, -1);
+                continue;
+            }
+
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            print_error("Cannot send records to [%d]: %d", socket, errno);
+            return ERR_SECURE_CANNOT_SEND;
+        }
+
+        // skip what went out
+        while (count > 0 && (size_t)sent >= iov->iov_len)
+        {
+            sent -= iov->iov_len;
+            iov++;
+            count--;
+        }
+
+        if (count > 0)
+        {
+            iov->iov_base = (byte*)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return 0;
+}
+
+/* compare two tags in constant time */
+static int tag_equals(const byte* a, const byte* b, size_t len)
+{
+    byte diff = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+    {
+        diff |= a[i] ^ b[i];
+    }
+
+    return diff == 0;
+}
+
+/* HMAC of LABEL followed by the two nonces */
+static void handshake_mac(const byte* key, size_t keylen, const char* label,
+                          const byte* cnonce, const byte* snonce, byte* out)
+{
+    hmac_state hmac;
+
+    hmac_sha256_init(&hmac, key, keylen);
+    hmac_sha256_process(&hmac, (const byte*)label, strlen(label));
+    hmac_sha256_process(&hmac, cnonce, SECURE_NONCE_SIZE);
+    hmac_sha256_process(&hmac, snonce, SECURE_NONCE_SIZE);
+    hmac_sha256_done(&hmac, out);
+}
+
+/* derive the keys of one direction from the MASTER secret */
+static void derive_direction(const byte* master, const char* label, struct securedirection* dir)
+{
+    byte derived[SHA256_HASH_SIZE];
+    char name[16];
+
+    snprintf(name, sizeof(name), "%s key", label);
+    hmac_sha256(master, SHA256_HASH_SIZE, (const byte*)name, strlen(name), derived);
+    aes_key_setup(derived, 32, &dir->cipher);
+
+    snprintf(name, sizeof(name), "%s mac", label);
+    hmac_sha256(master, SHA256_HASH_SIZE, (const byte*)name, strlen(name), dir->mackey);
+
+    snprintf(name, sizeof(name), "%s iv", label);
+    hmac_sha256(master, SHA256_HASH_SIZE, (const byte*)name, strlen(name), derived);
+    memcpy(dir->prefix, derived, sizeof(dir->prefix));
+
+    dir->sequence = 0;
+    ZEROMEM(derived, sizeof(derived));
+}
+
+/* create the channel once both nonces are known */
+static struct securechannel* create_channel(int socket, const byte* key, size_t keylen,
+                                            const byte* cnonce, const byte* snonce, int client)
+{
+    struct securechannel* channel = NULL;
+    byte master[SHA256_HASH_SIZE];
+
+    if ((channel = (struct securechannel*)calloc(1, sizeof(struct securechannel))) == NULL)
+    {
+        return NULL;
+    }
+
+    handshake_mac(key, keylen, "master", cnonce, snonce, master);
+    derive_direction(master, client ? "c2s" : "s2c", &channel->out);
+    derive_direction(master, client ? "s2c" : "c2s", &channel->in);
+    ZEROMEM(master, sizeof(master));
+
+    channel->socket = socket;
+    return channel;
+}
+
+/* get a nonce from a Fortuna PRNG seeded by the system */
+static int generate_nonce(byte* nonce)
+{
+    prng_state prng;
+    byte seed[32];
+    int result = -1;
+
+    if (getrandom(seed, sizeof(seed), 0) == sizeof(seed)
+        && prng_create(&prng, seed, sizeof(seed)) == CRYPTO_OK)
+    {
+        result = fortuna_read(nonce, SECURE_NONCE_SIZE, &prng) == SECURE_NONCE_SIZE ? 0 : -1;
+        prng_close(&prng);
+    }
+
+    ZEROMEM(seed, sizeof(seed));
+    return result;
+}
+
+struct securechannel* secure_connect(int socket, const byte* key, size_t keylen)
+{
+    byte hello[SECURE_HELLO_SIZE];
+    byte reply[SECURE_NONCE_SIZE + SHA256_HASH_SIZE];
+    byte mac[SHA256_HASH_SIZE];
+    byte* cnonce = hello + 5;
+    byte* snonce = reply;
+    struct iovec iov;
+
+    memcpy(hello, SECURE_MAGIC, 4);
+    hello[4] = SECURE_VERSION;
+    if (generate_nonce(cnonce) < 0)
+    {
+        print_error("Cannot generate the handshake nonce");
+        return NULL;
+    }
+
+    iov.iov_base = hello;
+    iov.iov_len = sizeof(hello);
+    if (send_all(socket, &iov, 1) < 0 || read_exact(socket, reply, sizeof(reply)) != sizeof(reply))
+    {
+        print_error("Handshake interrupted with [%d]", socket);
+        return NULL;
+    }
+
+    // the server proves it knows the key
+    handshake_mac(key, keylen, "server", cnonce, snonce, mac);
+    if (!tag_equals(mac, reply + SECURE_NONCE_SIZE, SHA256_HASH_SIZE))
+    {
+        print_error("Server [%d] does not know the key", socket);
+        return NULL;
+    }
+
+    handshake_mac(key, keylen, "client", cnonce, snonce, mac);
+    iov.iov_base = mac;
+    iov.iov_len = sizeof(mac);
+    if (send_all(socket, &iov, 1) < 0)
+    {
+        return NULL;
+    }
+
+    return create_channel(socket, key, keylen, cnonce, snonce, 1);
+}
+
+struct securechannel* secure_accept(int socket, const byte* key, size_t keylen)
+{
+    byte hello[SECURE_HELLO_SIZE];
+    byte reply[SECURE_NONCE_SIZE + SHA256_HASH_SIZE];
+    byte mac[SHA256_HASH_SIZE];
+    byte* cnonce = hello + 5;
+    byte* snonce = reply;
+    struct iovec iov;
+
+    if (read_exact(socket, hello, sizeof(hello)) != sizeof(hello)
+        || memcmp(hello, SECURE_MAGIC, 4) != 0 || hello[4] != SECURE_VERSION)
+    {
+        print_error("Invalid handshake from [%d]", socket);
+        return NULL;
+    }
+
+    if (generate_nonce(snonce) < 0)
+    {
+        print_error("Cannot generate the handshake nonce");
+        return NULL;
+    }
+
+    handshake_mac(key, keylen, "server", cnonce, snonce, reply + SECURE_NONCE_SIZE);
+    iov.iov_base = reply;
+    iov.iov_len = sizeof(reply);
+    if (send_all(socket, &iov, 1) < 0 || read_exact(socket, mac, sizeof(mac)) != sizeof(mac))
+    {
+        print_error("Handshake interrupted with [%d]", socket);
+        return NULL;
+    }
+
+    // the client proves it knows the key
+    handshake_mac(key, keylen, "client", cnonce, snonce, reply + SECURE_NONCE_SIZE);
+    if (!tag_equals(mac, reply + SECURE_NONCE_SIZE, SHA256_HASH_SIZE))
+    {
+        print_error("Client [%d] does not know the key", socket);
+        return NULL;
+    }
+
+    return create_channel(socket, key, keylen, cnonce, snonce, 0);
+}
+
+/* compute the tag of a record with the current sequence number */
+static void record_tag(struct securedirection* dir, const byte* header,
+                       const byte* payload, size_t len, byte* tag)
+{
+    byte sequence[8];
+    byte mac[SHA256_HASH_SIZE];
+    hmac_state hmac;
+
+    STORE64H(dir->sequence, sequence);
+    hmac_sha256_init(&hmac, dir->mackey, sizeof(dir->mackey));
+    hmac_sha256_process(&hmac, sequence, sizeof(sequence));
+    hmac_sha256_process(&hmac, header, SECURE_HEADER_SIZE);
+    hmac_sha256_process(&hmac, payload, len);
+    hmac_sha256_done(&hmac, mac);
+    memcpy(tag, mac, SECURE_TAG_SIZE);
+}
+
+/* encrypt or decrypt a payload in place with the current sequence number */
+static void record_crypt(struct securedirection* dir, byte* payload, size_t len)
+{
+    byte counter[16];
+
+    memcpy(counter, dir->prefix, 4);
+    STORE64H(dir->sequence, counter + 4);
+    memset(counter + 12, 0, 4);
+    aes_ctr_encrypt(payload, counter, len, payload, &dir->cipher);
+}
+
+int secure_send_batch(struct securechannel* channel, struct iovec* records, int count)
+{
+    struct iovec iov[SECURE_BATCH_SIZE * 3];
+    byte headers[SECURE_BATCH_SIZE][SECURE_HEADER_SIZE];
+    byte tags[SECURE_BATCH_SIZE][SECURE_TAG_SIZE];
+    struct securedirection* dir = &channel->out;
+    int i, batch, result;
+
+    while (count > 0)
+    {
+        batch = count < SECURE_BATCH_SIZE ? count : SECURE_BATCH_SIZE;
+
+        for (i = 0; i < batch; i++)
+        {
+            if (records[i].iov_len > SECURE_MAX_RECORD)
+            {
+                return ERR_SECURE_INVALID_RECORD;
+            }
+
+            if (dir->sequence == UINT64_MAX)
+            {
+                return ERR_SECURE_SEQUENCE_EXHAUSTED;
+            }
+
+            STORE32H((ulong32)records[i].iov_len, headers[i]);
+            record_crypt(dir, (byte*)records[i].iov_base, records[i].iov_len);
+            record_tag(dir, headers[i], (byte*)records[i].iov_base, records[i].iov_len, tags[i]);
+            dir->sequence++;
+
+            iov[i * 3].iov_base = headers[i];
+            iov[i * 3].iov_len = SECURE_HEADER_SIZE;
+            iov[i * 3 + 1] = records[i];
+            iov[i * 3 + 2].iov_base = tags[i];
+            iov[i * 3 + 2].iov_len = SECURE_TAG_SIZE;
+        }
+
+        if ((result = send_all(channel->socket, iov, batch * 3)) < 0)
+        {
+            return result;
+        }
+
+        records += batch;
+        count -= batch;
+    }
+
+    return 0;
+}
+
+int secure_send(struct securechannel* channel, byte* data, size_t len)
+{
+    struct iovec record;
+
+    record.iov_base = data;
+    record.iov_len = len;
+    return secure_send_batch(channel, &record, 1);
+}
+
+/* verify and decrypt the record of length LEN starting at HEADER */
+static int open_record(struct securechannel* channel, byte* header, size_t len)
+{
+    byte tag[SECURE_TAG_SIZE];
+    byte* payload = header + SECURE_HEADER_SIZE;
+
+    record_tag(&channel->in, header, payload, len, tag);
+    if (!tag_equals(tag, payload + len, SECURE_TAG_SIZE))
+    {
+        print_error("Invalid record tag from [%d]", channel->socket);
+        return ERR_SECURE_INVALID_RECORD;
+    }
+
+    record_crypt(&channel->in, payload, len);
+    channel->in.sequence++;
+    return 0;
+}
+
+ssize_t secure_receive(struct securechannel* channel, byte* buffer, size_t size)
+{
+    byte header[SECURE_HEADER_SIZE];
+    byte received[SECURE_TAG_SIZE];
+    byte tag[SECURE_TAG_SIZE];
+    ulong32 len = 0;
+    ssize_t result = 0;
+
+    if ((result = read_exact(channel->socket, header, SECURE_HEADER_SIZE)) != SECURE_HEADER_SIZE)
+    {
+        return result <= 0 ? result : ERR_SECURE_CANNOT_RECEIVE;
+    }
+
+    LOAD32H(len, header);
+    if (len > SECURE_MAX_RECORD || len > size)
+    {
+        return ERR_SECURE_INVALID_RECORD;
+    }
+
+    if (read_exact(channel->socket, buffer, len) != len
+        || read_exact(channel->socket, received, SECURE_TAG_SIZE) != SECURE_TAG_SIZE)
+    {
+        return ERR_SECURE_CANNOT_RECEIVE;
+    }
+
+    record_tag(&channel->in, header, buffer, len, tag);
+    if (!tag_equals(tag, received, SECURE_TAG_SIZE))
+    {
+        print_error("Invalid record tag from [%d]", channel->socket);
+        return ERR_SECURE_INVALID_RECORD;
+    }
+
+    record_crypt(&channel->in, buffer, len);
+    channel->in.sequence++;
+    return len;
+}
+
+int secure_receive_batch(struct securechannel* channel, byte* buffer, size_t size,
+                         struct iovec* records, int max)
+{
+    struct pollfd pfd;
+    size_t offset = 0;
+    ssize_t received = 0;
+    ulong32 len = 0;
+    int count = 0;
+    int result = 0;
+
+    // the bytes left by the previous call go to the front
+    if (channel->consumed > 0)
+    {
+        memmove(buffer, buffer + channel->consumed, channel->pending);
+        channel->consumed = 0;
+    }
+
+    while (1)
+    {
+        // open every complete record in place
+        while (count < max && channel->pending - offset >= SECURE_HEADER_SIZE)
+        {
+            LOAD32H(len, buffer + offset);
+            if (len > SECURE_MAX_RECORD)
+            {
+                return ERR_SECURE_INVALID_RECORD;
+            }
+
+            if (channel->pending - offset < SECURE_HEADER_SIZE + len + SECURE_TAG_SIZE)
+            {
+                break;
+            }
+
+            if ((result = open_record(channel, buffer + offset, len)) < 0)
+            {
+                return result;
+            }
+
+            records[count].iov_base = buffer + offset + SECURE_HEADER_SIZE;
+            records[count].iov_len = len;
+            count++;
+            offset += SECURE_HEADER_SIZE + len + SECURE_TAG_SIZE;
+        }
+
+        if (count > 0)
+        {
+            channel->pending -= offset;
+            channel->consumed = offset;
+            return count;
+        }
+
+        if (channel->pending == size)
+        {
+            return ERR_SECURE_INVALID_RECORD;
+        }
+
+        if ((received = recv(channel->socket, buffer + channel->pending,
+                             size - channel->pending, 0)) > 0)
+        {
+            channel->pending += received;
+        }
+        else if (received == 0)
+        {
+            return 0;
+        }
+        else if (errno == EAGAIN || errno == EWOULDBLOCK)
+        {
+            pfd.fd = channel->socket;
+            pfd.events = POLLIN;
+            pfd.revents = 0;
+            poll(&pfd, 1, -1);
+        }
+        else if (errno != EINTR)
+        {
+            return ERR_SECURE_CANNOT_RECEIVE;
+        }
+    }
+}
+
+void secure_close(struct securechannel* channel)
+{
+    if (channel != NULL)
+    {
+        ZEROMEM(channel, sizeof(struct securechannel));
+        free(channel);
+    }
+}
@@ -0,0 +1,88 @@
+/*  Prototype for the encrypted channel
+
+    This prototype defines an optional record layer on top of a
+    connected socket. Both peers share a key before hand, a handshake
+    proves the knowledge of the key and derives the session keys from
+    random nonces. Each record is then encrypted with AES-256 in CTR mode
+    and authenticated with HMAC-SHA256.
+
+    The records are encrypted and decrypted in place in the buffers of
+    the caller, no copy of the data is made. Using this layer requires to
+    link libnpmcrypto.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef SECURE_H_
+#define SECURE_H_
+
+#include <sys/types.h>
+#include <sys/uio.h>
+#include "client.h"
+
+/* biggest payload of one record */
+#define SECURE_MAX_RECORD 16384
+
+/* bytes added to each record, header and authentication tag */
+#define SECURE_RECORD_OVERHEAD 20
+
+/* Opaque state of an encrypted channel */
+struct securechannel;
+
+/* Run the handshake as the client on the connected __socket, with the
+   pre-shared key __key. Return the channel, NULL if the handshake failed
+   or the peer does not know the key */
+extern struct securechannel* secure_connect(int __socket, const byte* __key, size_t __keylen);
+
+/* Run the handshake as the server on the accepted __socket */
+extern struct securechannel* secure_accept(int __socket, const byte* __key, size_t __keylen);
+
+/* Encrypt in place and send __count records, each up to SECURE_MAX_RECORD
+   bytes, with as few system calls as possible. The content of __records
+   is overwritten by the encrypted data. Return 0 if all the records are
+   sent, otherwise negative int */
+extern int secure_send_batch(struct securechannel* __channel, struct iovec* __records, 
+                             int __count);
+
+/* Encrypt in place and send one record */
+extern int secure_send(struct securechannel* __channel, byte* __data, size_t __length);
+
+/* Receive one record in __buffer, decrypted in place. Return the length
+   of the record, 0 when the peer closed the connection, otherwise
+   negative int */
+extern ssize_t secure_receive(struct securechannel* __channel, byte* __buffer, size_t __size);
+
+/* Receive the records available on the socket in __buffer, decrypted in
+   place, blocking until there is at least one. __records points to each
+   record in __buffer, they are valid until the next call with the same
+   channel and buffer. The same buffer must be used for every call, it
+   should hold at least one record with its overhead. Once used on a
+   channel, secure_receive must not be called on it anymore. Return the number
+   of records, 0 when the peer closed the connection, otherwise negative
+   int */
+extern int secure_receive_batch(struct securechannel* __channel, byte* __buffer, size_t __size,
+                                struct iovec* __records, int __max);
+
+/* Release the channel and erase its keys. The socket is not closed */
+extern void secure_close(struct securechannel* __channel);
+
+#endif
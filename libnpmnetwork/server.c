@@ -21,6 +21,7 @@
     LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
     SOFTWARE. */
+#define _GNU_SOURCE
 #include <ctype.h>
 #include <signal.h>
 #include <stdio.h>
@@ -31,16 +32,44 @@
 #include <sys/un.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/wait.h>
+#include <poll.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <time.h>
 #include <netinet/in.h>
 #include "server.h"
+#include "busypoll.h"
 
 /* internal error code */
 const int8_t ERR_CANNOT_BIND_SOCKET    = -1;
 const int8_t ERR_CANNOT_CREATE_SOCKET  = -2;
+const int8_t ERR_CANNOT_SEND_TO_CLIENT = -3;
+const int8_t ERR_CANNOT_POLL_CLIENT    = -4;
+
+/* number of events handled per call to epoll_wait */
+#define POLL_EVENTS_SIZE 256
+
+/* connections accepted and waiting for a thread in thread mode */
+#define DISPATCH_QUEUE_SIZE 1024
 
 /* catching termination signal to cleanup */
 void close_resources(int signum);
 int g_serverSocket;
+volatile sig_atomic_t g_serverStopped = 0;
+
+/* epoll instance of the event loop running on the thread */
+__thread int t_pollEpoll = -1;
+
+/* log the stop requested by the signal handler, which cannot log itself */
+static void report_server_stopped(void)
+{
+    if (g_serverStopped != 0)
+    {
+        print_info("Closed socket [%d]", g_serverSocket);
+    }
+}
 
 int create_new_server(struct serverparams *params) 
 {
@@ -53,8 +82,32 @@ int create_new_server(struct serverparams *params)
     // socket created, listening the server
     if (socket > 0)
     {
-        set_sigterm_handler(socket);                               
-        listen_and_accept(socket, params->queue, params->request_handler);
+        int workers = params->workers > 0 ? params->workers : (int)sysconf(_SC_NPROCESSORS_ONLN);
+
+        set_sigterm_handler(socket);
+        switch (params->mode)
+        {
+          case SERVER_MODE_EVENT:
+            if (params->workers > 1)
+            {
+                listen_and_prefork(socket, params->queue, workers, NULL, params->event_handler);
+            }
+            else
+            {
+                listen_and_poll(socket, params->queue, params->event_handler);
+            }
+            break;
+          case SERVER_MODE_PREFORK:
+            listen_and_prefork(socket, params->queue, workers, params->request_handler, NULL);
+            break;
+          case SERVER_MODE_THREADS:
+            listen_and_dispatch(socket, params->queue, workers, params->request_handler);
+            break;
+          default:
+            listen_and_accept(socket, params->queue, params->request_handler);
+            break;
+        }
+        report_server_stopped();
         return 0;
     }   
                             
@@ -66,6 +119,7 @@ int open_server_socket(int port, int domain, int type, int protocol)
 {
     struct sockaddr_in saddr;
     int ssocket = 0;
+    int reuse = 1;
     
     print_info("Creating a new server socket to listen on port %d", port);
     
@@ -75,6 +129,9 @@ int open_server_socket(int port, int domain, int type, int protocol)
         return ERR_CANNOT_CREATE_SOCKET;
     }
     
+    // a restarted server binds again while old connections are in TIME_WAIT
+    setsockopt(ssocket, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
     memset(&saddr, 0, sizeof(saddr));
     saddr.sin_family = domain;
     saddr.sin_port = htons(port);
@@ -98,16 +155,29 @@ void listen_and_accept(int socket, int queue, void (*handler)(int))
     
     memset(&caddr, 0, caddrLen);
     listen(socket, queue);
+
+    // the children are reaped by the kernel
+    signal(SIGCHLD, SIG_IGN);
         
     print_info("Now accepting incoming connection");
 
     while ((client = accept(socket, (struct sockaddr*)&caddr, &caddrLen)) != -1)
     {
+        u_int64_t accepted = g_traceSink != NULL ? trace_clock() : 0;
+        
         print_info("Connection accepted from %d", caddr.sin_addr.s_addr);
         if (fork() == 0) // in child process
         {   
             close(socket);
+            // the accept time was taken in the parent
+            if (g_traceSink != NULL)
+            {
+                g_traceSink(client, TRACE_ACCEPT, accepted);
+            }
+            trace_expect_read(client);
+            TRACE_EVENT(client, TRACE_HANDLER_START);
             handler(client);
+            TRACE_EVENT(client, TRACE_HANDLER_END);
         }
         else // in parent process
         {
@@ -116,6 +186,503 @@ void listen_and_accept(int socket, int queue, void (*handler)(int))
     }
 }
 
+/* serve the connections accepted on SOCKET one after the other */
+static void accept_serially(int socket, void (*handler)(int))
+{
+    int client = 0;
+
+    while (g_serverStopped == 0)
+    {
+        if ((client = accept(socket, NULL, NULL)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+
+        TRACE_EVENT(client, TRACE_ACCEPT);
+        trace_expect_read(client);
+        TRACE_EVENT(client, TRACE_HANDLER_START);
+        handler(client);
+        TRACE_EVENT(client, TRACE_HANDLER_END);
+        close(client);
+    }
+}
+
+void listen_and_prefork(int socket, int queue, int workers, void (*handler)(int),
+                        int (*eventHandler)(int, struct connection*))
+{
+    pid_t* pids = NULL;
+    int i, started = 0;
+
+    if ((pids = (pid_t*)calloc(workers, sizeof(pid_t))) == NULL)
+    {
+        return;
+    }
+
+    // the workers share the queue of the socket, the kernel wakes one
+    listen(socket, queue);
+    print_info("Starting %d worker processes", workers);
+
+    for (i = 0; i < workers; i++)
+    {
+        if ((pids[i] = fork()) == 0)
+        {
+            free(pids);
+            if (eventHandler != NULL)
+            {
+                listen_and_poll(socket, queue, eventHandler);
+            }
+            else
+            {
+                accept_serially(socket, handler);
+            }
+            report_server_stopped();
+            exit(0);
+        }
+
+        if (pids[i] < 0)
+        {
+            print_error("Cannot start worker process: %d", errno);
+            break;
+        }
+        started++;
+    }
+
+    // wait for a worker to end or for SIGTERM, then stop them all
+    while (g_serverStopped == 0 && started > 0)
+    {
+        if (wait(NULL) > 0)
+        {
+            started--;
+        }
+        else if (errno != EINTR)
+        {
+            break;
+        }
+    }
+
+    for (i = 0; i < workers; i++)
+    {
+        if (pids[i] > 0)
+        {
+            kill(pids[i], SIGTERM);
+        }
+    }
+    while (wait(NULL) > 0 || errno == EINTR);
+    free(pids);
+}
+
+/* connections waiting for a thread, and the ones being served */
+struct dispatchqueue
+  {
+    pthread_mutex_t lock;
+    pthread_cond_t notEmpty;
+    pthread_cond_t notFull;
+    int clients[DISPATCH_QUEUE_SIZE];
+    int head;
+    int count;
+    int* serving;       // connection of each thread, -1 when waiting
+    int stopped;
+    void (*handler)(int);
+  };
+
+struct dispatchworker
+  {
+    struct dispatchqueue* queue;
+    int index;
+  };
+
+static void* run_dispatch_worker(void* arg)
+{
+    struct dispatchworker* worker = (struct dispatchworker*)arg;
+    struct dispatchqueue* queue = worker->queue;
+    int client = 0;
+
+    while (1)
+    {
+        pthread_mutex_lock(&queue->lock);
+        while (queue->count == 0 && queue->stopped == 0)
+        {
+            pthread_cond_wait(&queue->notEmpty, &queue->lock);
+        }
+        if (queue->count == 0)
+        {
+            pthread_mutex_unlock(&queue->lock);
+            break;
+        }
+        client = queue->clients[queue->head];
+        queue->head = (queue->head + 1) % DISPATCH_QUEUE_SIZE;
+        queue->count--;
+        queue->serving[worker->index] = client;
+        pthread_cond_signal(&queue->notFull);
+        pthread_mutex_unlock(&queue->lock);
+
+        trace_expect_read(client);
+        TRACE_EVENT(client, TRACE_HANDLER_START);
+        queue->handler(client);
+        TRACE_EVENT(client, TRACE_HANDLER_END);
+
+        pthread_mutex_lock(&queue->lock);
+        queue->serving[worker->index] = -1;
+        pthread_mutex_unlock(&queue->lock);
+        close(client);
+    }
+
+    return NULL;
+}
+
+void listen_and_dispatch(int socket, int queueSize, int workers, void (*handler)(int))
+{
+    struct dispatchqueue queue;
+    struct dispatchworker* contexts = NULL;
+    pthread_t* threads = NULL;
+    sigset_t blocked, previous;
+    int i, client, started = 0;
+
+    memset(&queue, 0, sizeof(queue));
+    pthread_mutex_init(&queue.lock, NULL);
+    pthread_cond_init(&queue.notEmpty, NULL);
+    pthread_cond_init(&queue.notFull, NULL);
+    queue.handler = handler;
+    queue.serving = (int*)malloc(sizeof(int) * workers);
+    threads = (pthread_t*)calloc(workers, sizeof(pthread_t));
+    contexts = (struct dispatchworker*)calloc(workers, sizeof(struct dispatchworker));
+    if (queue.serving == NULL || threads == NULL || contexts == NULL)
+    {
+        free(queue.serving);
+        free(threads);
+        free(contexts);
+        return;
+    }
+
+    // SIGTERM must interrupt the accepting thread, not a worker
+    sigemptyset(&blocked);
+    sigaddset(&blocked, SIGTERM);
+    sigaddset(&blocked, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &blocked, &previous);
+    for (i = 0; i < workers; i++)
+    {
+        queue.serving[i] = -1;
+        contexts[i].queue = &queue;
+        contexts[i].index = i;
+        if (pthread_create(&threads[i], NULL, run_dispatch_worker, &contexts[i]) != 0)
+        {
+            print_error("Cannot start worker thread: %d", errno);
+            break;
+        }
+        started++;
+    }
+    pthread_sigmask(SIG_SETMASK, &previous, NULL);
+
+    listen(socket, queueSize);
+    print_info("Now accepting incoming connection on %d threads", started);
+
+    while (g_serverStopped == 0 && started > 0)
+    {
+        if ((client = accept(socket, NULL, NULL)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            break;
+        }
+        TRACE_EVENT(client, TRACE_ACCEPT);
+
+        pthread_mutex_lock(&queue.lock);
+        while (queue.count == DISPATCH_QUEUE_SIZE)
+        {
+            pthread_cond_wait(&queue.notFull, &queue.lock);
+        }
+        queue.clients[(queue.head + queue.count) % DISPATCH_QUEUE_SIZE] = client;
+        queue.count++;
+        pthread_cond_signal(&queue.notEmpty);
+        pthread_mutex_unlock(&queue.lock);
+    }
+
+    // end the connections being served so their handlers return
+    pthread_mutex_lock(&queue.lock);
+    queue.stopped = 1;
+    for (i = 0; i < started; i++)
+    {
+        if (queue.serving[i] >= 0)
+        {
+            shutdown(queue.serving[i], SHUT_RDWR);
+        }
+    }
+    while (queue.count > 0)
+    {
+        close(queue.clients[queue.head]);
+        queue.head = (queue.head + 1) % DISPATCH_QUEUE_SIZE;
+        queue.count--;
+    }
+    pthread_cond_broadcast(&queue.notEmpty);
+    pthread_mutex_unlock(&queue.lock);
+
+    for (i = 0; i < started; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+
+    pthread_mutex_destroy(&queue.lock);
+    pthread_cond_destroy(&queue.notEmpty);
+    pthread_cond_destroy(&queue.notFull);
+    free(queue.serving);
+    free(threads);
+    free(contexts);
+}
+
+/* accept and close one pending connection on SOCKET when out of
+   descriptors, using the one held in RESERVE. Return 0 when a connection
+   was dropped, otherwise -1 */
+static int drop_pending(int socket, int* reserve)
+{
+    int client = 0;
+
+    if (*reserve < 0)
+    {
+        return -1;
+    }
+
+    close(*reserve);
+    if ((client = accept(socket, NULL, NULL)) >= 0)
+    {
+        close(client);
+    }
+    *reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+
+    return client >= 0 ? 0 : -1;
+}
+
+/* accept all the pending connections on the non-blocking server SOCKET.
+   Out of descriptors, they are dropped, or the level-triggered SOCKET
+   would stay readable and the loop would spin */
+static void accept_pending(int socket, int epoll, struct conntable* table, int* reserve)
+{
+    struct epoll_event event;
+    int client = 0;
+    int dropped = 0;
+
+    while (1)
+    {
+        if ((client = accept4(socket, NULL, NULL, SOCK_NONBLOCK)) < 0)
+        {
+            if (errno == EINTR || errno == ECONNABORTED)
+            {
+                continue;
+            }
+            if ((errno == EMFILE || errno == ENFILE) && drop_pending(socket, reserve) == 0)
+            {
+                dropped++;
+                continue;
+            }
+            break;
+        }
+
+        if (conntable_add(table, client) == NULL)
+        {
+            close(client);
+            continue;
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN | EPOLLRDHUP;
+        event.data.fd = client;
+        if (epoll_ctl(epoll, EPOLL_CTL_ADD, client, &event) < 0)
+        {
+            print_error("Cannot poll client socket [%d]: %d", client, errno);
+            conntable_remove(table, client);
+            close(client);
+            continue;
+        }
+
+        TRACE_EVENT(client, TRACE_ACCEPT);
+    }
+
+    if (dropped > 0)
+    {
+        print_error("Out of descriptors, %d connections dropped", dropped);
+    }
+}
+
+int poll_for_output(int socket, int output)
+{
+    struct epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.events = (output ? EPOLLOUT : EPOLLIN) | EPOLLRDHUP;
+    event.data.fd = socket;
+    if (t_pollEpoll < 0 || epoll_ctl(t_pollEpoll, EPOLL_CTL_MOD, socket, &event) < 0)
+    {
+        print_error("Cannot change the events of client socket [%d]: %d", socket, errno);
+        return ERR_CANNOT_POLL_CLIENT;
+    }
+
+    return 0;
+}
+
+/* release everything about the connection on CLIENT */
+static void close_connection(int client, struct conntable* table)
+{
+    conntable_remove(table, client);
+    close(client);
+}
+
+void listen_and_poll(int socket, int queue, int (*handler)(int, struct connection*))
+{
+    struct epoll_event events[POLL_EVENTS_SIZE];
+    struct epoll_event event;
+    struct conntable table;
+    struct connection* conn = NULL;
+    int epoll = 0;
+    int reserve = -1;
+    int ready = 0;
+    int i, client;
+
+    if (conntable_create(&table, 0) < 0)
+    {
+        return;
+    }
+
+    if ((epoll = epoll_create1(0)) < 0)
+    {
+        print_error("Cannot create the epoll instance: %d", errno);
+        conntable_destroy(&table);
+        return;
+    }
+
+    fcntl(socket, F_SETFL, fcntl(socket, F_GETFL, 0) | O_NONBLOCK);
+    listen(socket, queue);
+
+    // held to be able to accept and drop connections once out of descriptors
+    reserve = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    t_pollEpoll = epoll;
+
+    // with several worker processes, only one is woken per connection
+    memset(&event, 0, sizeof(event));
+    event.events = EPOLLIN | EPOLLEXCLUSIVE;
+    event.data.fd = socket;
+    epoll_ctl(epoll, EPOLL_CTL_ADD, socket, &event);
+
+    print_info("Now polling incoming connection");
+
+    while (g_serverStopped == 0)
+    {
+        if ((ready = busy_epoll_wait(epoll, events, POLL_EVENTS_SIZE, -1)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            print_error("Error while waiting for events: %d", errno);
+            break;
+        }
+
+        for (i = 0; i < ready; i++)
+        {
+            client = events[i].data.fd;
+            if (client == socket)
+            {
+                accept_pending(socket, epoll, &table, &reserve);
+                continue;
+            }
+
+            if ((conn = conntable_get(&table, client)) == NULL)
+            {
+                continue;
+            }
+
+            // the send timestamps of the kernel are queued as errors
+            if ((events[i].events & EPOLLERR) && trace_send_completions(client) > 0)
+            {
+                events[i].events &= ~EPOLLERR;
+            }
+
+            // data to read, or room to send what the handler held back
+            if (events[i].events & (EPOLLIN | EPOLLOUT))
+            {
+                int result = 0;
+
+                // the first data read with trace_recv, once per
+                // connection like in the other modes
+                if (!conn->traced)
+                {
+                    trace_expect_read(client);
+                }
+
+                conn->status = CONN_ACTIVE;
+                TRACE_EVENT(client, TRACE_HANDLER_START);
+                result = handler(client, conn);
+                TRACE_EVENT(client, TRACE_HANDLER_END);
+                conn->traced = !trace_cancel_read(client);
+
+                if (result < 0)
+                {
+                    close_connection(client, &table);
+                    continue;
+                }
+                conn->status = CONN_IDLE;
+                conn->lastactive = (u_int32_t)time(NULL);
+            }
+            else if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+            {
+                close_connection(client, &table);
+            }
+        }
+    }
+
+    if (reserve >= 0)
+    {
+        close(reserve);
+    }
+    t_pollEpoll = -1;
+    conntable_destroy(&table);
+    close(epoll);
+}
+
+int send_to_client(int socket, const void* data, size_t len)
+{
+    const u_int8_t* cursor = (const u_int8_t*)data;
+    struct pollfd pfd;
+    ssize_t sent = 0;
+
+    // the previous responses had time to leave, report their timestamps
+    trace_send_completions(socket);
+
+    while (len > 0)
+    {
+        if ((sent = send(socket, cursor, len, MSG_NOSIGNAL)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+            {
+                print_error("Cannot send data to client [%d]: %d", socket, errno);
+                return ERR_CANNOT_SEND_TO_CLIENT;
+            }
+
+            // non-blocking socket full, wait for room in the send buffer
+            pfd.fd = socket;
+            pfd.events = POLLOUT;
+            pfd.revents = 0;
+            poll(&pfd, 1, -1);
+            continue;
+        }
+
+        cursor += sent;
+        len -= sent;
+    }
+
+    TRACE_EVENT(socket, TRACE_LAST_WRITE);
+    return 0;
+}
+
 void set_sigterm_handler(int serverSocketDesc)
 {
     g_serverSocket = serverSocketDesc;
@@ -129,7 +696,8 @@ void set_sigterm_handler(int serverSocketDesc)
 
 void close_resources(int signum)
 {
-    print_info("Closing socket [%d]", g_serverSocket);
+    // only async-signal-safe calls here, the server loops do the logging
+    g_serverStopped = 1;
     close(g_serverSocket);
 }
 
@@ -26,6 +26,16 @@
 #define SERVER_H_
 
 #include "internlog.h"
+#include "connection.h"
+#include "trace.h"
+
+/* Server modes */
+#define SERVER_MODE_FORK    0   // one process forked per connection
+#define SERVER_MODE_EVENT   1   // epoll event loop, in each worker process
+#define SERVER_MODE_PREFORK 2   // worker processes started upfront, each
+                                // serving one connection at a time
+#define SERVER_MODE_THREADS 3   // one accepting thread handing the
+                                // connections to a pool of threads
 
 /* Defines the parameter needed by the server to start correctly */
 struct serverparams
@@ -36,6 +46,10 @@ struct serverparams
     int protocol;
     int queue;
     void (*request_handler)(int);
+    int mode;
+    int (*event_handler)(int, struct connection*);
+    int workers;    // processes or threads of the event, prefork and thread
+                    // modes. When 0, one per CPU, one process in event mode
   };
 
 /* Create a new server and start listening. Return negative int if the server
@@ -49,6 +63,37 @@ extern int open_server_socket(int __port, int __domain, int __type, int __protoc
 /* Listen and accept new connection, must have an opened SOCKET */
 extern void listen_and_accept(int __socket, int __queue, void (*__handler)(int));
 
+/* Start __workers processes accepting on SOCKET, each running
+   listen_and_poll when __eventHandler is given, otherwise calling
+   __handler for one connection at a time and closing it after. The
+   calling process waits for them and stops them on SIGTERM */
+extern void listen_and_prefork(int __socket, int __queue, int __workers,
+                               void (*__handler)(int),
+                               int (*__eventHandler)(int, struct connection*));
+
+/* Accept on SOCKET and hand each connection to one of __workers threads
+   calling __handler, the connection is closed after */
+extern void listen_and_dispatch(int __socket, int __queue, int __workers, 
+                                void (*__handler)(int));
+
+/* Listen and poll the connections in a single process. __handler is called
+   each time a connection has data to read, it must not block and returns a
+   negative int to close the connection. Must have an opened SOCKET */
+extern void listen_and_poll(int __socket, int __queue, 
+                            int (*__handler)(int, struct connection*));
+
+/* From an event handler, have the loop call it again when __socket can
+   send more data instead of when it has data to read, while __output is
+   not 0. A handler keeps what the client did not take yet and sends it
+   then, rather than waiting in send_to_client. Return 0 on success,
+   otherwise negative int */
+extern int poll_for_output(int __socket, int __output);
+
+/* Send all of __data to the client, waiting for room in the send buffer
+   of a non-blocking socket. Return 0 if all the byte are sent, otherwise
+   negative int */
+extern int send_to_client(int __socket, const void* __data, size_t __length);
+
 /* Set the SIGTERM handler. This is optional and the client can choose to
    handle the signal. */
 extern void set_sigterm_handler(int  __socket);
@@ -0,0 +1,300 @@
+/*  Implementation of the request lifecycle tracing
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/net_tstamp.h>
+#include <linux/errqueue.h>
+#include "trace.h"
+#include "internlog.h"
+
+/* error code */
+const int ERR_CANNOT_ENABLE_TIMESTAMPS = -1;
+
+/* room for the control messages holding the timestamps */
+#define CONTROL_BUFFER_SIZE 256
+
+trace_sink g_traceSink = NULL;
+
+/* sockets with kernel timestamps enabled, indexed by descriptor. The
+   table is sized from RLIMIT_NOFILE when first needed, the sockets past
+   its end are looked up in the kernel */
+u_int8_t* g_timestamped = NULL;
+u_int32_t g_timestampedSize = 0;
+int g_timestampedOverflow = 0;
+pthread_once_t g_timestampedOnce = PTHREAD_ONCE_INIT;
+
+/* socket whose next data read by the thread is the first of a request */
+__thread int t_firstReadSocket = -1;
+
+void set_trace_sink(trace_sink sink)
+{
+    g_traceSink = sink;
+}
+
+u_int64_t trace_clock(void)
+{
+    struct timespec now;
+
+    // served by the vDSO, no system call
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (u_int64_t)now.tv_sec * 1000000000ULL + (u_int64_t)now.tv_nsec;
+}
+
+/* reserve the table of timestamped sockets, only the pages of the
+   sockets used are committed */
+static void create_timestamped_table(void)
+{
+    struct rlimit limit;
+    void* table = NULL;
+
+    if (getrlimit(RLIMIT_NOFILE, &limit) < 0 || limit.rlim_cur == RLIM_INFINITY)
+    {
+        return;
+    }
+
+    table = mmap(NULL, (size_t)limit.rlim_cur, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (table != MAP_FAILED)
+    {
+        g_timestamped = (u_int8_t*)table;
+        __atomic_store_n(&g_timestampedSize, (u_int32_t)limit.rlim_cur, __ATOMIC_RELEASE);
+    }
+}
+
+/* tell if SOCKET has kernel timestamps enabled */
+static int socket_timestamped(int socket)
+{
+    int options = 0;
+    socklen_t length = sizeof(options);
+
+    if (socket >= 0 && (u_int32_t)socket < __atomic_load_n(&g_timestampedSize, __ATOMIC_ACQUIRE))
+    {
+        return __atomic_load_n(&g_timestamped[socket], __ATOMIC_RELAXED);
+    }
+
+    return __atomic_load_n(&g_timestampedOverflow, __ATOMIC_RELAXED)
+           && getsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &options, &length) == 0
+           && options != 0;
+}
+
+int enable_kernel_timestamps(int socket, int flags)
+{
+    int options = SOF_TIMESTAMPING_OPT_ID | SOF_TIMESTAMPING_OPT_TSONLY;
+
+    if (flags & TRACE_KERNEL_SOFTWARE)
+    {
+        options |= SOF_TIMESTAMPING_SOFTWARE
+                   | SOF_TIMESTAMPING_RX_SOFTWARE
+                   | SOF_TIMESTAMPING_TX_SOFTWARE;
+    }
+
+    if (flags & TRACE_KERNEL_HARDWARE)
+    {
+        options |= SOF_TIMESTAMPING_RAW_HARDWARE
+                   | SOF_TIMESTAMPING_RX_HARDWARE
+                   | SOF_TIMESTAMPING_TX_HARDWARE;
+    }
+
+    if (setsockopt(socket, SOL_SOCKET, SO_TIMESTAMPING, &options, sizeof(options)) < 0)
+    {
+        print_error("Cannot enable kernel timestamps on socket [%d]", socket);
+        return ERR_CANNOT_ENABLE_TIMESTAMPS;
+    }
+
+    pthread_once(&g_timestampedOnce, &create_timestamped_table);
+    if ((u_int32_t)socket < __atomic_load_n(&g_timestampedSize, __ATOMIC_ACQUIRE))
+    {
+        __atomic_store_n(&g_timestamped[socket], 1, __ATOMIC_RELAXED);
+    }
+    else
+    {
+        __atomic_store_n(&g_timestampedOverflow, 1, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+/* convert a kernel software timestamp, taken with the realtime clock, to
+   the monotonic clock used by the other events */
+static u_int64_t realtime_to_monotonic(const struct timespec* ts)
+{
+    struct timespec realtime;
+    u_int64_t monotonic = trace_clock();
+    u_int64_t stamp = (u_int64_t)ts->tv_sec * 1000000000ULL + (u_int64_t)ts->tv_nsec;
+    u_int64_t now;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    now = (u_int64_t)realtime.tv_sec * 1000000000ULL + (u_int64_t)realtime.tv_nsec;
+    return monotonic - (now - stamp);
+}
+
+/* report the timestamps found in the control messages of MSG */
+static int report_timestamps(int socket, struct msghdr* msg, int software, int hardware)
+{
+    struct cmsghdr* cmsg = NULL;
+    struct scm_timestamping* stamps = NULL;
+    int reported = 0;
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg != NULL; cmsg = CMSG_NXTHDR(msg, cmsg))
+    {
+        if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_TIMESTAMPING)
+        {
+            continue;
+        }
+
+        // ts[0] is the software timestamp, ts[2] the raw hardware one
+        stamps = (struct scm_timestamping*)CMSG_DATA(cmsg);
+        if (stamps->ts[0].tv_sec != 0 || stamps->ts[0].tv_nsec != 0)
+        {
+            g_traceSink(socket, software, realtime_to_monotonic(&stamps->ts[0]));
+            reported++;
+        }
+
+        if (stamps->ts[2].tv_sec != 0 || stamps->ts[2].tv_nsec != 0)
+        {
+            g_traceSink(socket, hardware,
+                        (u_int64_t)stamps->ts[2].tv_sec * 1000000000ULL
+                        + (u_int64_t)stamps->ts[2].tv_nsec);
+            reported++;
+        }
+    }
+
+    return reported;
+}
+
+void trace_expect_read(int socket)
+{
+    t_firstReadSocket = g_traceSink != NULL ? socket : -1;
+}
+
+int trace_cancel_read(int socket)
+{
+    if (t_firstReadSocket != socket)
+    {
+        return 0;
+    }
+
+    t_firstReadSocket = -1;
+    return 1;
+}
+
+ssize_t trace_recv(int socket, void* buffer, size_t length, int flags)
+{
+    char control[CONTROL_BUFFER_SIZE];
+    struct msghdr msg;
+    struct iovec iov;
+    ssize_t received = 0;
+
+    if (g_traceSink == NULL || !socket_timestamped(socket))
+    {
+        received = recv(socket, buffer, length, flags);
+        if (received > 0 && socket == t_firstReadSocket)
+        {
+            t_firstReadSocket = -1;
+            TRACE_EVENT(socket, TRACE_FIRST_READ);
+        }
+        return received;
+    }
+
+    iov.iov_base = buffer;
+    iov.iov_len = length;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control;
+    msg.msg_controllen = sizeof(control);
+
+    if ((received = recvmsg(socket, &msg, flags)) > 0)
+    {
+        if (socket == t_firstReadSocket)
+        {
+            t_firstReadSocket = -1;
+            TRACE_EVENT(socket, TRACE_FIRST_READ);
+        }
+        report_timestamps(socket, &msg, TRACE_KERNEL_RX, TRACE_HARDWARE_RX);
+    }
+
+    return received;
+}
+
+int drain_error_queue(int socket, int* zerocopied)
+{
+    char control[CONTROL_BUFFER_SIZE];
+    struct msghdr msg;
+    struct cmsghdr* cmsg = NULL;
+    struct sock_extended_err* error = NULL;
+    int read = 0;
+
+    // with SOF_TIMESTAMPING_OPT_TSONLY the messages carry no payload
+    while (1)
+    {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(socket, &msg, MSG_ERRQUEUE | MSG_DONTWAIT) < 0)
+        {
+            break;
+        }
+
+        read++;
+        if (g_traceSink != NULL)
+        {
+            report_timestamps(socket, &msg, TRACE_KERNEL_TX, TRACE_HARDWARE_TX);
+        }
+
+        // a zerocopy notification covers the sends ee_info to ee_data
+        for (cmsg = CMSG_FIRSTHDR(&msg); cmsg != NULL && zerocopied != NULL; 
+             cmsg = CMSG_NXTHDR(&msg, cmsg))
+        {
+            if ((cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR)
+                || (cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR))
+            {
+                error = (struct sock_extended_err*)CMSG_DATA(cmsg);
+                if (error->ee_errno == 0 && error->ee_origin == SO_EE_ORIGIN_ZEROCOPY)
+                {
+                    *zerocopied += error->ee_data - error->ee_info + 1;
+                }
+            }
+        }
+    }
+
+    return read;
+}
+
+int trace_send_completions(int socket)
+{
+    // drained even without a sink, the queue would keep EPOLLERR raised
+    if (!socket_timestamped(socket))
+    {
+        return 0;
+    }
+
+    return drain_error_queue(socket, NULL);
+}
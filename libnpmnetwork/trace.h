@@ -0,0 +1,119 @@
+/*  Prototype for the request lifecycle tracing
+
+    This prototype defines the hooks called by the server and the client
+    at each step of a request. Each event is timestamped with the
+    monotonic clock and delivered to a sink set by the application. No
+    work is done when there is no sink.
+
+    When enabled on a socket, the kernel timestamps of the data received
+    and sent are reported as well, so the time spent in the kernel queues
+    can be told apart from the time spent in the application.
+
+    MIT License
+
+    Copyright (c) [2017] [Neilson P. Marcil]
+
+    Permission is hereby granted, free of charge, to any person obtaining a copy
+    of this software and associated documentation files (the "Software"), to deal
+    in the Software without restriction, including without limitation the rights
+    to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+    copies of the Software, and to permit persons to whom the Software is
+    furnished to do so, subject to the following conditions:
+
+    The above copyright notice and this permission notice shall be included in all
+    copies or substantial portions of the Software.
+
+    THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+    IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+    FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+    AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+    LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+    OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+    SOFTWARE. */
+
+#ifndef TRACE_H_
+#define TRACE_H_
+
+#include <sys/types.h>
+
+/* server events */
+#define TRACE_ACCEPT          0   // connection accepted
+#define TRACE_FIRST_READ      1   // first byte of the request read
+#define TRACE_HANDLER_START   2   // request handler called
+#define TRACE_HANDLER_END     3   // request handler returned
+#define TRACE_LAST_WRITE      4   // last byte of the response written
+
+/* client events */
+#define TRACE_CONNECT         5   // connected to host
+#define TRACE_FIRST_SEND      6   // first byte of the request sent
+#define TRACE_FIRST_RECV      7   // first byte of the response received
+
+/* kernel events, reported in the monotonic clock like the others */
+#define TRACE_KERNEL_RX       8   // data received by the kernel
+#define TRACE_KERNEL_TX       9   // data handed to the device by the kernel
+
+/* kernel events from the network card clock, not comparable to the
+   monotonic clock. Only reported when the interface has hardware
+   timestamping enabled (SIOCSHWTSTAMP) */
+#define TRACE_HARDWARE_RX     10  // data received by the network card
+#define TRACE_HARDWARE_TX     11  // data sent by the network card
+
+/* flags for enable_kernel_timestamps */
+#define TRACE_KERNEL_SOFTWARE 1
+#define TRACE_KERNEL_HARDWARE 2
+
+/* Receive an EVENT on SOCKET that happened at TIMESTAMP nanoseconds */
+typedef void (*trace_sink)(int __socket, int __event, u_int64_t __timestamp);
+
+/* current sink, NULL when tracing is disabled */
+extern trace_sink g_traceSink;
+
+/* Set the sink receiving the events, NULL to disable tracing. The sink is
+   called on the thread, or in the process, where the event happened */
+extern void set_trace_sink(trace_sink __sink);
+
+/* Read the monotonic clock in nanoseconds */
+extern u_int64_t trace_clock(void);
+
+/* Ask the kernel to timestamp the data received and sent on __socket.
+   __flags combines TRACE_KERNEL_SOFTWARE and TRACE_KERNEL_HARDWARE. The
+   A descriptor reused after closing the socket is still checked for
+   send timestamps, at the cost of one system call per send.
+   Return 0 on success, otherwise negative int, errno will be set */
+extern int enable_kernel_timestamps(int __socket, int __flags);
+
+/* Report TRACE_FIRST_READ when the calling thread next receives data on
+   __socket with trace_recv. The servers call it before each handler, so
+   the event is only reported for handlers reading with trace_recv */
+extern void trace_expect_read(int __socket);
+
+/* Stop waiting for the first read of __socket. Return 1 when nothing was
+   read since trace_expect_read, otherwise 0 */
+extern int trace_cancel_read(int __socket);
+
+/* Receive data like recv(2). When kernel timestamps are enabled, the
+   receive time of the data is reported to the sink. The kernel only
+   hands these times with the data, so TRACE_KERNEL_RX is reported for
+   the handlers reading with trace_recv and never for the others */
+extern ssize_t trace_recv(int __socket, void* __buffer, size_t __length, int __flags);
+
+/* Read the send timestamps waiting in the error queue of __socket,
+   without blocking, and report them when a sink is set. The kernel
+   queues them once the data has left, so the library calls it before
+   the next send, on a response and when the event loop sees EPOLLERR.
+   Does nothing on a socket without kernel timestamps. Return the number
+   of messages read from the error queue */
+extern int trace_send_completions(int __socket);
+
+/* Read the whole error queue of __socket without blocking, reporting the
+   send timestamps to the sink when one is set. The sends completed with
+   MSG_ZEROCOPY are added to __zerocopied when it is not NULL. Return the
+   number of messages read */
+extern int drain_error_queue(int __socket, int* __zerocopied);
+
+/* Deliver __event to the sink with the current time */
+#define TRACE_EVENT(__socket, __event)                                  \
+    do { if (g_traceSink != NULL) {                                     \
+        g_traceSink((__socket), (__event), trace_clock()); } } while (0)
+
+#endif
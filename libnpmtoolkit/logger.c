@@ -22,62 +22,1552 @@
     OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
     SOFTWARE. */
     
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stddef.h>
 #include <time.h>
+#include <pthread.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+
+/* LOGGER_DISABLE only removes the calls made by the users of the logger */
+#undef LOGGER_DISABLE
 #include "logger.h"
 
-/* define to remove the logger entirely from the source code */
-#ifdef LOGGER_DISABLE
-#define logmsg(...)
-#endif
+/* marker left in a ring when a record does not fit before its end */
+#define LOG_RECORD_WRAP     0xFFFFFFFF
+
+/* size of the batch handed to write(2) by the flush thread */
+#define LOG_BATCH_SIZE      65536
+
+/* smallest buffer given to a thread, enough for the fixed size arguments
+   of a binary message */
+#define LOG_MIN_LINE_SIZE   1024
+
+/* descriptor standing for the output of the logger, a user sink or g_logFd */
+#define LOG_OUTPUT          -1
+
+/* smallest buffer accepted by set_buffer_size, room for the prefix */
+#define MIN_BUFFER_SIZE     64
+
+/* period of the checks of the log file, in milliseconds */
+#define LOG_SINK_TICK       100
+
+/* most formats that can be registered for binary logging */
+#define LOG_MAX_FORMATS     4096
+
+/* Buffer of one logging thread. Only that thread moves the tail and only
+   the consumer, the flush thread or a caller holding g_flushLock, moves
+   the head, so neither side takes a lock. Each record is its length on
+   4 bytes followed by the line, padded to 8 bytes. */
+struct logring
+  {
+    u_int64_t head __attribute__((aligned(64)));
+    u_int64_t tail __attribute__((aligned(64)));
+    u_int32_t size;
+    int orphaned;               // the thread exited, free once drained
+    struct logring* next;
+    char* data;
+  };
+
+/* Format string registered for binary logging, parsed once */
+struct logformat
+  {
+    char* format;
+    u_int8_t argc;
+    u_int8_t types[LOG_MAX_ARGS];
+  };
+
+/* error code */
+const int ERR_LOGGER_CANNOT_ALLOCATE = -1;
+const int ERR_LOGGER_CANNOT_START = -2;
+const int ERR_LOGGER_CANNOT_WRITE = -3;
+const int ERR_LOGGER_CANNOT_OPEN = -4;
+
+/* initialisation of the logger, done once */
+static void init_logger(void);
+
+/* start the thread taking care of the log file */
+static int start_sink_thread(void);
+
+/* start the threads a forked child inherited the need for */
+static void start_child_threads(void);
 
 /* default values and constant */
 uint32_t    g_bufferSize            = DEFAULT_BUFFER_SIZE;
 LogLevel    g_logPriority           = LOGGER_INFO;
 const char* TIMESTAMP_FORMAT        = "%Y-%m-%d %H:%M:%S";
-const char* LOG_MSG_FORMAT_PREFIX   = "%s [%d] [%d]: ";
+const char* LEVEL_PREFIX_FORMAT     = " [%d] [%d]: ";
+int         g_logFd                 = STDOUT_FILENO;
+int         g_outputFd              = STDOUT_FILENO;
+log_sink    g_sink                  = NULL;
+void*       g_sinkContext           = NULL;
+pid_t       g_pid                   = 0;
+pthread_once_t g_loggerOnce         = PTHREAD_ONCE_INIT;
+pthread_key_t  g_lineKey;
+__thread char* t_line               = NULL;
+__thread uint32_t t_lineSize        = 0;
+
+/* prefix cache, the level and pid part is shared and only rebuilt in a
+   forked child, the timestamp is reformatted once per second per thread */
+int                 g_timestampPrecision = LOGGER_PRECISION_SECONDS;
+char                g_levelPrefix[LOGGER_VERBOSE + 1][32];
+size_t              g_levelPrefixLength[LOGGER_VERBOSE + 1];
+__thread time_t     t_cachedSecond  = -1;
+__thread char       t_timestamp[32];
+__thread size_t     t_timestampLength = 0;
+
+/* asynchronous mode */
+int                 g_asyncEnabled  = 0;
+int                 g_asyncRunning  = 0;
+int                 g_fullPolicy    = LOGGER_FULL_BLOCK;
+uint32_t            g_ringSize      = DEFAULT_RING_SIZE;
+u_int64_t           g_dropped       = 0;
+struct logring*     g_rings         = NULL;
+pthread_t           g_flushThread;
+pthread_mutex_t     g_flushLock     = PTHREAD_MUTEX_INITIALIZER;
+pthread_mutex_t     g_wakeLock      = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      g_wakeCond      = PTHREAD_COND_INITIALIZER;
+pthread_mutex_t     g_spaceLock     = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      g_spaceCond     = PTHREAD_COND_INITIALIZER;
+int                 g_spaceWaiters  = 0;    // threads blocked on a full ring
+int                 g_drainRequested = 0;   // a waiter needs a drain right away
+pthread_key_t       g_ringKey;
+char                g_batch[LOG_BATCH_SIZE];
+__thread struct logring* t_ring     = NULL;
+__thread uint64_t   t_sampleState   = 0;
+
+/* binary mode, a format is never freed once registered so its id can be
+   read without a lock */
+int                 g_binaryEnabled = 0;
+int                 g_binaryOwnFd   = 0;
+struct logformat*   g_formats[LOG_MAX_FORMATS];
+uint32_t            g_formatCount   = 0;
+pthread_mutex_t     g_formatLock    = PTHREAD_MUTEX_INITIALIZER;
+
+/* log file, only the process that opened it rotates it */
+struct logfileparams g_fileParams;
+char*               g_filePath      = NULL;
+int                 g_fileOwner     = 0;
+int                 g_sinkRunning   = 0;
+int                 g_fileShared    = 0;    // forked processes write to it
+int                 g_previousFd    = -1;   // last rotated file, trimmed later
+off_t               g_allocated     = 0;
+time_t              g_nextRotation  = 0;
+pthread_t           g_sinkThread;
+pthread_mutex_t     g_sinkLock      = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t      g_sinkCond      = PTHREAD_COND_INITIALIZER;
+
+/* threads of the parent a forked child starts with its first message */
+int                 g_startFlushThread = 0;
+int                 g_startSinkThread  = 0;
+
+/* build the "[level] [pid]: " part of the prefix for every level */
+static void build_level_prefixes(void)
+{
+    int level;
+
+    g_pid = getpid();
+    for (level = LOGGER_FATAL; level <= LOGGER_VERBOSE; level++)
+    {
+        g_levelPrefixLength[level] = snprintf(g_levelPrefix[level], sizeof(g_levelPrefix[level]),
+                                              LEVEL_PREFIX_FORMAT, level, g_pid);
+    }
+}
+
+/* write the timestamp and the level prefix in buffer, which holds at
+   least 64 bytes. Return the length of the prefix */
+static size_t format_prefix(char* buffer, LogLevel priority)
+{
+    struct timespec now;
+    struct tm tm_info;
+    size_t length = 0;
+    long fraction = 0;
+    int digits = g_timestampPrecision;
+
+    pthread_once(&g_loggerOnce, &init_logger);
+
+    // the coarse clock is enough for seconds and is read from the vDSO
+    // without touching the hardware clock
+    clock_gettime(digits == LOGGER_PRECISION_SECONDS ? CLOCK_REALTIME_COARSE : CLOCK_REALTIME, &now);
+    if (now.tv_sec != t_cachedSecond)
+    {
+        localtime_r(&now.tv_sec, &tm_info);
+        t_timestampLength = strftime(t_timestamp, sizeof(t_timestamp), TIMESTAMP_FORMAT, &tm_info);
+        t_cachedSecond = now.tv_sec;
+    }
+
+    memcpy(buffer, t_timestamp, t_timestampLength);
+    length = t_timestampLength;
+
+    if (digits > 0)
+    {
+        int i;
+        fraction = digits == LOGGER_PRECISION_MILLIS ? now.tv_nsec / 1000000 : now.tv_nsec / 1000;
+        buffer[length] = '.';
+        for (i = digits; i > 0; i--)
+        {
+            buffer[length + i] = '0' + fraction % 10;
+            fraction /= 10;
+        }
+        length += digits + 1;
+    }
+
+    if (priority < LOGGER_FATAL || priority > LOGGER_VERBOSE)
+    {
+        priority = LOGGER_VERBOSE;
+    }
+
+    memcpy(buffer + length, g_levelPrefix[(int)priority], g_levelPrefixLength[(int)priority]);
+    return length + g_levelPrefixLength[(int)priority];
+}
+
+/* format the whole line, prefix and end of line included, in buffer.
+   Return the length of the line */
+static size_t format_message(char* buffer, size_t size, LogLevel priority,
+                             char* format, va_list args)
+{
+    char prefix[64];
+    size_t length = 0;
+    int written = 0;
+
+    length = format_prefix(prefix, priority);
+    if (length >= size - 2)
+    {
+        length = size - 2;
+        memcpy(buffer, prefix, length);
+    }
+    else
+    {
+        memcpy(buffer, prefix, length);
+        written = vsnprintf(buffer + length, size - length, format, args);
+        // on an encoding error only the prefix is kept
+        if (written >= 0 && (size_t)written >= size - length - 1)
+        {
+            length = size - 2;
+        }
+        else if (written > 0)
+        {
+            length += (size_t)written;
+        }
+    }
+
+    buffer[length++] = '\n';
+    buffer[length] = '\0';
+    return length;
+}
+
+/* write the whole buffer, retrying on partial writes and signals */
+static void write_fully(int fd, const char* buffer, size_t length)
+{
+    ssize_t written = 0;
+
+    while (length > 0)
+    {
+        if ((written = write(fd, buffer, length)) < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            return;
+        }
+
+        buffer += written;
+        length -= written;
+    }
+}
+
+/* write to fd, or to the sink of the logger when fd is LOG_OUTPUT */
+static void write_output(int fd, const char* buffer, size_t length)
+{
+    if (fd == LOG_OUTPUT)
+    {
+        if (g_sink != NULL)
+        {
+            g_sink(buffer, length, g_sinkContext);
+            return;
+        }
+        fd = g_logFd;
+    }
+
+    write_fully(fd, buffer, length);
+}
+
+/* wake up the flush thread, without waiting for it */
+static void wake_flush_thread(void)
+{
+    pthread_cond_signal(&g_wakeCond);
+}
+
+/* called when a logging thread exits, its ring is freed by the consumer */
+static void release_ring(void* ring)
+{
+    __atomic_store_n(&((struct logring*)ring)->orphaned, 1, __ATOMIC_RELEASE);
+    wake_flush_thread();
+}
+
+/* get the ring of the calling thread, creating and publishing it on the
+   first call. Return NULL if it cannot be allocated */
+static struct logring* thread_ring(void)
+{
+    struct logring* ring = t_ring;
+    uint32_t size = 4096;
+
+    if (ring != NULL)
+    {
+        return ring;
+    }
+
+    while (size < g_ringSize)
+    {
+        size <<= 1;
+    }
+
+    if (posix_memalign((void**)&ring, 64, sizeof(struct logring)) != 0)
+    {
+        return NULL;
+    }
+
+    memset(ring, 0, sizeof(struct logring));
+    ring->size = size;
+    if ((ring->data = (char*)malloc(size)) == NULL)
+    {
+        free(ring);
+        return NULL;
+    }
+
+    // push on the list of rings, the consumer only unlinks from behind the head
+    ring->next = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&g_rings, &ring->next, ring, 1,
+                                        __ATOMIC_RELEASE, __ATOMIC_ACQUIRE));
+
+    pthread_setspecific(g_ringKey, ring);
+    t_ring = ring;
+    return ring;
+}
+
+/* sleep until the flush thread frees TOTAL bytes after TAIL in RING, or
+   stops */
+static void wait_for_space(struct logring* ring, u_int64_t tail, u_int64_t total)
+{
+    // unlike the other wake ups this one must not be lost
+    pthread_mutex_lock(&g_wakeLock);
+    g_drainRequested = 1;
+    pthread_cond_signal(&g_wakeCond);
+    pthread_mutex_unlock(&g_wakeLock);
+
+    pthread_mutex_lock(&g_spaceLock);
+    __atomic_add_fetch(&g_spaceWaiters, 1, __ATOMIC_SEQ_CST);
+    while (__atomic_load_n(&g_asyncRunning, __ATOMIC_ACQUIRE)
+           && tail + total - __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST) > ring->size)
+    {
+        pthread_cond_wait(&g_spaceCond, &g_spaceLock);
+    }
+    __atomic_sub_fetch(&g_spaceWaiters, 1, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&g_spaceLock);
+}
+
+/* wake the threads waiting for room once the rings have been drained */
+static void signal_space(void)
+{
+    // the heads were moved before, the waiters read them after counting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&g_spaceWaiters, __ATOMIC_RELAXED) > 0)
+    {
+        pthread_mutex_lock(&g_spaceLock);
+        pthread_cond_broadcast(&g_spaceCond);
+        pthread_mutex_unlock(&g_spaceLock);
+    }
+}
+
+/* copy one line in the ring of the calling thread. Return 0 when queued,
+   -1 when the line has to be written by the caller */
+static int queue_message(struct logring* ring, const char* line, size_t length)
+{
+    u_int64_t head, tail, offset, contiguous, needed, total;
+
+    needed = (4 + length + 7) & ~(u_int64_t)7;
+    if (needed > ring->size / 2)
+    {
+        return -1;
+    }
+
+    for (;;)
+    {
+        tail = ring->tail;
+        head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+        offset = tail & (ring->size - 1);
+        contiguous = ring->size - offset;
+        total = needed + (contiguous < needed ? contiguous : 0);
+
+        if (tail + total - head <= ring->size)
+        {
+            break;
+        }
+
+        if (g_fullPolicy == LOGGER_FULL_DROP)
+        {
+            __atomic_fetch_add(&g_dropped, 1, __ATOMIC_RELAXED);
+            return 0;
+        }
+        else if (g_fullPolicy == LOGGER_FULL_SYNC || !g_asyncRunning)
+        {
+            return -1;
+        }
+
+        wait_for_space(ring, tail, total);
+    }
+
+    if (contiguous < needed)
+    {
+        *(u_int32_t*)(ring->data + offset) = LOG_RECORD_WRAP;
+        tail += contiguous;
+        offset = 0;
+    }
+
+    *(u_int32_t*)(ring->data + offset) = (u_int32_t)length;
+    memcpy(ring->data + offset + 4, line, length);
+    __atomic_store_n(&ring->tail, tail + needed, __ATOMIC_RELEASE);
+
+    // half full, do not wait for the next tick of the flush thread
+    if (tail + needed - head > ring->size / 2)
+    {
+        wake_flush_thread();
+    }
+
+    return 0;
+}
+
+/* move the records of one ring to the batch, writing the batch each time
+   it is full. Called with g_flushLock held. Return the batch length */
+static size_t drain_ring(struct logring* ring, size_t batched)
+{
+    u_int64_t head = ring->head;
+    u_int64_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+    while (head < tail)
+    {
+        u_int64_t offset = head & (ring->size - 1);
+        u_int32_t length = *(u_int32_t*)(ring->data + offset);
+
+        if (length == LOG_RECORD_WRAP)
+        {
+            head += ring->size - offset;
+            continue;
+        }
+
+        if (batched + length > LOG_BATCH_SIZE)
+        {
+            write_output(LOG_OUTPUT, g_batch, batched);
+            batched = 0;
+        }
+
+        memcpy(g_batch + batched, ring->data + offset + 4, length);
+        batched += length;
+        head += (4 + length + 7) & ~(u_int64_t)7;
+    }
+
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+    return batched;
+}
+
+/* write the pending messages of every thread and free the rings of the
+   threads that exited. Called with g_flushLock held */
+static void drain_rings(void)
+{
+    struct logring* ring = __atomic_load_n(&g_rings, __ATOMIC_ACQUIRE);
+    struct logring* previous = NULL;
+    size_t batched = 0;
+
+    while (ring != NULL)
+    {
+        struct logring* next = ring->next;
+        struct logring* expected = ring;
+        int orphaned = __atomic_load_n(&ring->orphaned, __ATOMIC_ACQUIRE);
+
+        batched = drain_ring(ring, batched);
+
+        // the head of the list is also moved by the logging threads
+        if (orphaned && (previous != NULL
+            || __atomic_compare_exchange_n(&g_rings, &expected, next, 0,
+                                           __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)))
+        {
+            if (previous != NULL)
+            {
+                previous->next = next;
+            }
+            free(ring->data);
+            free(ring);
+        }
+        else
+        {
+            previous = ring;
+        }
+
+        ring = next;
+    }
+    signal_space();
+
+    if (batched > 0)
+    {
+        write_output(LOG_OUTPUT, g_batch, batched);
+    }
+}
+
+/* background thread writing the messages in batches */
+static void* flush_thread(void* arg)
+{
+    struct timespec deadline;
+
+    pthread_mutex_lock(&g_wakeLock);
+    while (__atomic_load_n(&g_asyncRunning, __ATOMIC_ACQUIRE))
+    {
+        pthread_mutex_unlock(&g_wakeLock);
+
+        pthread_mutex_lock(&g_flushLock);
+        drain_rings();
+        pthread_mutex_unlock(&g_flushLock);
+
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += 10000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_mutex_lock(&g_wakeLock);
+        if (__atomic_load_n(&g_asyncRunning, __ATOMIC_ACQUIRE) && !g_drainRequested)
+        {
+            pthread_cond_timedwait(&g_wakeCond, &g_wakeLock, &deadline);
+        }
+        g_drainRequested = 0;
+    }
+    pthread_mutex_unlock(&g_wakeLock);
+
+    return NULL;
+}
+
+/* fill the header of a binary record */
+static void fill_record(struct logrecord* record, int type, LogLevel priority,
+                        uint32_t id, size_t length)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_REALTIME, &now);
+    record->length = (uint16_t)length;
+    record->type = (uint8_t)type;
+    record->level = priority;
+    record->id = id;
+    record->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+    record->pid = (uint32_t)g_pid;
+    record->reserved = 0;
+}
+
+/* write the definition of a format to fd or LOG_OUTPUT, called with g_formatLock and
+   g_flushLock held. Return 0 on success, otherwise negative int */
+static int write_format_record(int fd, uint32_t id)
+{
+    struct logformat* def = g_formats[id];
+    size_t formatLength = strlen(def->format) + 1;
+    size_t length = sizeof(struct logrecord) + 1 + def->argc + formatLength;
+    char* record = NULL;
+
+    if (length > UINT16_MAX || (record = (char*)malloc(length)) == NULL)
+    {
+        return ERR_LOGGER_CANNOT_WRITE;
+    }
+
+    fill_record((struct logrecord*)record, LOG_RECORD_FORMAT, 0, id, length);
+    record[sizeof(struct logrecord)] = def->argc;
+    memcpy(record + sizeof(struct logrecord) + 1, def->types, def->argc);
+    memcpy(record + sizeof(struct logrecord) + 1 + def->argc, def->format, formatLength);
+    write_output(fd, record, length);
+
+    free(record);
+    return 0;
+}
+
+/* write the record starting a binary log and the definition of every
+   format registered so far to fd or LOG_OUTPUT, called with g_formatLock and g_flushLock held */
+static void write_log_start(int fd)
+{
+    char record[sizeof(struct logrecord) + 8];
+    uint32_t id;
+
+    fill_record((struct logrecord*)record, LOG_RECORD_START, 0, 0, sizeof(record));
+    memcpy(record + sizeof(struct logrecord), LOG_BINARY_MAGIC, 8);
+    write_output(fd, record, sizeof(record));
+
+    for (id = 1; id <= g_formatCount; id++)
+    {
+        write_format_record(fd, id);
+    }
+}
+
+/* start the thread writing the queued messages */
+static int start_flush_thread(void)
+{
+    __atomic_store_n(&g_asyncRunning, 1, __ATOMIC_RELEASE);
+    if (pthread_create(&g_flushThread, NULL, &flush_thread, NULL) != 0)
+    {
+        g_asyncRunning = 0;
+        return ERR_LOGGER_CANNOT_START;
+    }
+
+    return 0;
+}
+
+/* no message is left in flight across fork, the child starts with empty
+   rings and starts its own threads when it first logs */
+static void prepare_fork(void)
+{
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+}
+
+static void resume_parent(void)
+{
+    g_fileShared = g_filePath != NULL;
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+}
+
+static void resume_child(void)
+{
+    struct logring* ring = NULL;
+    struct logrecord record;
+    pid_t parent = g_pid;
+
+    for (ring = g_rings; ring != NULL; ring = ring->next)
+    {
+        ring->head = ring->tail;
+        if (ring != t_ring)
+        {
+            ring->orphaned = 1;
+        }
+    }
+
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+    pthread_mutex_init(&g_wakeLock, NULL);
+    pthread_cond_init(&g_wakeCond, NULL);
+    pthread_mutex_init(&g_spaceLock, NULL);
+    pthread_cond_init(&g_spaceCond, NULL);
+    g_spaceWaiters = 0;
+    g_drainRequested = 0;
+    build_level_prefixes();
+
+    // the child inherits the formats of the parent, tell the decoder
+    if (g_binaryEnabled)
+    {
+        fill_record(&record, LOG_RECORD_FORK, 0, (uint32_t)parent, sizeof(record));
+        write_output(LOG_OUTPUT, (char*)&record, sizeof(record));
+    }
+
+    // creating threads here would slow down every fork, even the ones
+    // followed by exec
+    g_startFlushThread = g_asyncRunning;
+
+    // the parent keeps rotating the log file, the child follows
+    if (g_filePath != NULL)
+    {
+        pthread_mutex_init(&g_sinkLock, NULL);
+        pthread_cond_init(&g_sinkCond, NULL);
+        g_fileOwner = 0;
+        g_previousFd = -1;
+        g_startSinkThread = 1;
+    }
+}
+
+static void start_child_threads(void)
+{
+    pthread_mutex_lock(&g_wakeLock);
+    if (__atomic_exchange_n(&g_startFlushThread, 0, __ATOMIC_ACQ_REL)
+        && start_flush_thread() != 0)
+    {
+        // the messages are written by the threads logging them
+        __atomic_store_n(&g_asyncEnabled, 0, __ATOMIC_RELEASE);
+    }
+    pthread_mutex_unlock(&g_wakeLock);
+
+    pthread_mutex_lock(&g_sinkLock);
+    if (__atomic_exchange_n(&g_startSinkThread, 0, __ATOMIC_ACQ_REL))
+    {
+        start_sink_thread();
+    }
+    pthread_mutex_unlock(&g_sinkLock);
+}
+
+/* write what is still queued when the process exits */
+static void flush_at_exit(void)
+{
+    if (__atomic_load_n(&g_asyncEnabled, __ATOMIC_ACQUIRE))
+    {
+        flush_log();
+    }
+}
+
+static void free_line(void* line)
+{
+    free(line);
+}
+
+static void init_logger(void)
+{
+    build_level_prefixes();
+    pthread_key_create(&g_ringKey, &release_ring);
+    pthread_key_create(&g_lineKey, &free_line);
+    pthread_atfork(&prepare_fork, &resume_parent, &resume_child);
+
+    // a forked child inherits the handler
+    atexit(&flush_at_exit);
+}
+
+/* get the buffer of the calling thread to build one message, at least
+   g_bufferSize bytes. Return NULL if it cannot be allocated */
+static char* thread_line(void)
+{
+    uint32_t size = g_bufferSize < LOG_MIN_LINE_SIZE ? LOG_MIN_LINE_SIZE : g_bufferSize;
+    char* line = NULL;
+
+    if (t_line != NULL && t_lineSize >= size)
+    {
+        return t_line;
+    }
+
+    pthread_once(&g_loggerOnce, &init_logger);
+    if ((line = (char*)realloc(t_line, size)) == NULL)
+    {
+        return NULL;
+    }
+
+    pthread_setspecific(g_lineKey, line);
+    t_line = line;
+    t_lineSize = size;
+    return line;
+}
+
+/* hand a complete line or record to the flush thread, or write it */
+static void emit(const char* data, size_t length)
+{
+    struct logring* ring = NULL;
+
+    if (__atomic_load_n(&g_startFlushThread, __ATOMIC_RELAXED)
+        || __atomic_load_n(&g_startSinkThread, __ATOMIC_RELAXED))
+    {
+        start_child_threads();
+    }
+
+    if (__atomic_load_n(&g_asyncEnabled, __ATOMIC_ACQUIRE) && (ring = thread_ring()) != NULL
+        && queue_message(ring, data, length) == 0)
+    {
+        return;
+    }
+
+    write_output(LOG_OUTPUT, data, length);
+}
+
+int enable_async_logging(uint32_t ringSize, int policy)
+{
+    pthread_once(&g_loggerOnce, &init_logger);
+
+    if (g_asyncEnabled)
+    {
+        return 0;
+    }
+
+    g_ringSize = ringSize == 0 ? DEFAULT_RING_SIZE : ringSize;
+    g_fullPolicy = policy;
+
+    // nothing written with printf before must come after the async messages
+    fflush(stdout);
+
+    if (start_flush_thread() != 0)
+    {
+        return ERR_LOGGER_CANNOT_START;
+    }
+
+    __atomic_store_n(&g_asyncEnabled, 1, __ATOMIC_RELEASE);
+    return 0;
+}
+
+void disable_async_logging(void)
+{
+    int started = 0;
+
+    if (!g_asyncEnabled)
+    {
+        return;
+    }
+
+    __atomic_store_n(&g_asyncEnabled, 0, __ATOMIC_RELEASE);
+
+    // a forked child that never logged has no flush thread to stop
+    pthread_mutex_lock(&g_wakeLock);
+    started = !__atomic_exchange_n(&g_startFlushThread, 0, __ATOMIC_ACQ_REL);
+    __atomic_store_n(&g_asyncRunning, 0, __ATOMIC_RELEASE);
+    pthread_cond_signal(&g_wakeCond);
+    pthread_mutex_unlock(&g_wakeLock);
+    if (started)
+    {
+        pthread_join(g_flushThread, NULL);
+    }
+
+    // the threads waiting for room write their message themselves
+    pthread_mutex_lock(&g_spaceLock);
+    pthread_cond_broadcast(&g_spaceCond);
+    pthread_mutex_unlock(&g_spaceLock);
+
+    flush_log();
+}
+
+void flush_log(void)
+{
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    pthread_mutex_unlock(&g_flushLock);
+}
+
+uint64_t dropped_log_messages(void)
+{
+    return __atomic_load_n(&g_dropped, __ATOMIC_RELAXED);
+}
+
+/* find the type of every argument of a format. Return the number of
+   arguments, or -1 if one of them cannot be stored in a record */
+int parse_log_format(const char* format, uint8_t* types)
+{
+    const char* p = format;
+    int argc = 0;
+    int longDouble = 0;
+    size_t size = 0;
+
+    while ((p = strchr(p, '%')) != NULL)
+    {
+        p++;
+        if (*p == '%')
+        {
+            p++;
+            continue;
+        }
+
+        while (*p != '\0' && strchr("-+ #0'", *p) != NULL)
+        {
+            p++;
+        }
+
+        // width and precision, each can be taken from an int argument
+        if (*p == '*' && argc < LOG_MAX_ARGS)
+        {
+            types[argc++] = LOG_ARG_INT;
+            p++;
+        }
+        while (*p >= '0' && *p <= '9')
+        {
+            p++;
+        }
+        if (*p == '.')
+        {
+            p++;
+            if (*p == '*' && argc < LOG_MAX_ARGS)
+            {
+                types[argc++] = LOG_ARG_INT;
+                p++;
+            }
+            while (*p >= '0' && *p <= '9')
+            {
+                p++;
+            }
+        }
+
+        size = sizeof(int);
+        longDouble = 0;
+        switch (*p)
+        {
+          case 'h':
+            p += p[1] == 'h' ? 2 : 1;
+            break;
+          case 'l':
+            size = p[1] == 'l' ? sizeof(long long) : sizeof(long);
+            p += p[1] == 'l' ? 2 : 1;
+            break;
+          case 'q':
+            size = sizeof(long long);
+            p++;
+            break;
+          case 'j':
+            size = sizeof(intmax_t);
+            p++;
+            break;
+          case 'z':
+            size = sizeof(size_t);
+            p++;
+            break;
+          case 't':
+            size = sizeof(ptrdiff_t);
+            p++;
+            break;
+          case 'L':
+            longDouble = 1;
+            p++;
+            break;
+        }
+
+        if (argc == LOG_MAX_ARGS)
+        {
+            return -1;
+        }
+
+        switch (*p)
+        {
+          case 'd': case 'i': case 'o': case 'u': case 'x': case 'X':
+            types[argc++] = size > sizeof(int) ? LOG_ARG_LONG : LOG_ARG_INT;
+            break;
+          case 'c':
+            types[argc++] = LOG_ARG_INT;
+            break;
+          case 'e': case 'E': case 'f': case 'F': case 'g': case 'G': case 'a': case 'A':
+            types[argc++] = longDouble ? LOG_ARG_LONG_DOUBLE : LOG_ARG_DOUBLE;
+            break;
+          case 's':
+            if (size != sizeof(int))
+            {
+                return -1;
+            }
+            types[argc++] = LOG_ARG_STRING;
+            break;
+          case 'p':
+            types[argc++] = LOG_ARG_POINTER;
+            break;
+          default:
+            // %n writes to the caller and %m reads errno, both need the caller
+            return -1;
+        }
+        p++;
+    }
+
+    return argc;
+}
+
+uint32_t register_log_format(char* format)
+{
+    struct logformat* def = NULL;
+    uint8_t types[LOG_MAX_ARGS];
+    int argc = parse_log_format(format, types);
+    uint32_t id = 0;
+
+    if (argc < 0 || sizeof(struct logrecord) + 1 + argc + strlen(format) + 1 > UINT16_MAX
+        || (def = (struct logformat*)malloc(sizeof(struct logformat))) == NULL)
+    {
+        return 0;
+    }
+
+    if ((def->format = strdup(format)) == NULL)
+    {
+        free(def);
+        return 0;
+    }
+    def->argc = argc;
+    memcpy(def->types, types, argc);
+
+    pthread_once(&g_loggerOnce, &init_logger);
+    pthread_mutex_lock(&g_formatLock);
+    if (g_formatCount + 1 < LOG_MAX_FORMATS)
+    {
+        id = ++g_formatCount;
+        __atomic_store_n(&g_formats[id], def, __ATOMIC_RELEASE);
+
+        // the definition is in the log before any message using it
+        if (g_binaryEnabled)
+        {
+            pthread_mutex_lock(&g_flushLock);
+            write_format_record(LOG_OUTPUT, id);
+            pthread_mutex_unlock(&g_flushLock);
+        }
+    }
+    pthread_mutex_unlock(&g_formatLock);
+
+    if (id == 0)
+    {
+        free(def->format);
+        free(def);
+    }
+
+    return id;
+}
+
+int enable_binary_logging(int fd)
+{
+    pthread_once(&g_loggerOnce, &init_logger);
+    fflush(stdout);
+
+    // text messages still queued go to the previous output
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    g_binaryOwnFd = fd >= 0;
+    g_logFd = fd >= 0 ? fd : g_outputFd;
+    write_log_start(LOG_OUTPUT);
+    __atomic_store_n(&g_binaryEnabled, 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+    return 0;
+}
+
+void disable_binary_logging(void)
+{
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    __atomic_store_n(&g_binaryEnabled, 0, __ATOMIC_RELEASE);
+    g_binaryOwnFd = 0;
+    g_logFd = g_outputFd;
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+}
+
+/* reserve disk space ahead of the writes, so appending to the file does
+   not allocate blocks on the path of a writer */
+static void preallocate_log_file(int fd, off_t size)
+{
+    if (g_fileParams.prealloc > 0 && size + (off_t)g_fileParams.prealloc / 2 >= g_allocated
+        && fallocate(fd, FALLOC_FL_KEEP_SIZE, size, g_fileParams.prealloc) == 0)
+    {
+        g_allocated = size + g_fileParams.prealloc;
+    }
+}
+
+/* give back the space reserved after the end of a file. Truncating to
+   the current size would drop an append racing with it, so it is only
+   done once no process writes to the file anymore */
+static void release_log_file(int fd)
+{
+    struct stat info;
+
+    if (g_fileParams.prealloc > 0 && fstat(fd, &info) == 0)
+    {
+        ftruncate(fd, info.st_size);
+    }
+}
+
+static int open_log_path(void)
+{
+    return open(g_filePath, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+}
+
+/* move the current file aside and continue in a new one. The new file
+   takes the descriptor of the old one, writers never wait for it */
+static void rotate_log_file(void)
+{
+    char rotated[PATH_MAX];
+    struct tm tm_info;
+    time_t now = time(NULL);
+    size_t length = 0;
+    int suffix = 1;
+    int fd = -1;
+    int old = -1;
+
+    localtime_r(&now, &tm_info);
+    length = snprintf(rotated, sizeof(rotated), "%s.", g_filePath);
+    length += strftime(rotated + length, sizeof(rotated) - length, "%Y%m%d-%H%M%S", &tm_info);
+    while (access(rotated, F_OK) == 0 && suffix < 1000)
+    {
+        snprintf(rotated + length, sizeof(rotated) - length, ".%d", suffix++);
+    }
+
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    if (rename(g_filePath, rotated) == 0 && (fd = open_log_path()) >= 0)
+    {
+        // a binary log starts again with its definitions
+        if (g_binaryEnabled && !g_binaryOwnFd)
+        {
+            write_log_start(fd);
+        }
+
+        old = dup(g_outputFd);
+        dup3(fd, g_outputFd, O_CLOEXEC);
+        close(fd);
+    }
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+
+    if (old >= 0)
+    {
+        // forked processes may still append to the old file until their
+        // next check, it is trimmed at the next rotation
+        if (g_previousFd >= 0)
+        {
+            release_log_file(g_previousFd);
+            close(g_previousFd);
+        }
+        if (g_fileParams.syncinterval > 0)
+        {
+            fdatasync(old);
+        }
+        g_previousFd = old;
+        g_allocated = 0;
+        preallocate_log_file(g_outputFd, 0);
+    }
+}
+
+/* a forked process follows the rotations done by the process that
+   opened the file */
+static void follow_log_file(struct stat* current)
+{
+    struct stat named;
+    int fd = -1;
+
+    if (stat(g_filePath, &named) != 0
+        || (named.st_ino == current->st_ino && named.st_dev == current->st_dev))
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    if ((fd = open_log_path()) >= 0)
+    {
+        // the formats of this process are written again in the new file
+        if (g_binaryEnabled && !g_binaryOwnFd)
+        {
+            write_log_start(fd);
+        }
+
+        dup3(fd, g_outputFd, O_CLOEXEC);
+        close(fd);
+    }
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+}
+
+/* background thread rotating, preallocating and syncing the log file */
+static void* sink_thread(void* arg)
+{
+    struct timespec deadline, now, lastSync;
+    struct stat current;
+    long tick = LOG_SINK_TICK;
+    long elapsed = 0;
+
+    if (g_fileParams.syncinterval > 0 && g_fileParams.syncinterval < tick)
+    {
+        tick = g_fileParams.syncinterval < 10 ? 10 : g_fileParams.syncinterval;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &lastSync);
+    pthread_mutex_lock(&g_sinkLock);
+    while (g_sinkRunning)
+    {
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += tick / 1000;
+        deadline.tv_nsec += (tick % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+        {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+
+        pthread_cond_timedwait(&g_sinkCond, &g_sinkLock, &deadline);
+        if (!g_sinkRunning)
+        {
+            break;
+        }
+        pthread_mutex_unlock(&g_sinkLock);
+
+        if (fstat(g_outputFd, &current) == 0)
+        {
+            time_t seconds = time(NULL);
+
+            if (!g_fileOwner)
+            {
+                follow_log_file(&current);
+            }
+            else if (g_fileParams.interval > 0 && seconds >= g_nextRotation)
+            {
+                g_nextRotation = (seconds / g_fileParams.interval + 1) * g_fileParams.interval;
+                if (current.st_size > 0)
+                {
+                    rotate_log_file();
+                }
+            }
+            else if (g_fileParams.maxsize > 0 && (uint64_t)current.st_size >= g_fileParams.maxsize)
+            {
+                rotate_log_file();
+            }
+            else
+            {
+                preallocate_log_file(g_outputFd, current.st_size);
+            }
+        }
+
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        elapsed = (now.tv_sec - lastSync.tv_sec) * 1000 + (now.tv_nsec - lastSync.tv_nsec) / 1000000;
+        if (g_fileParams.syncinterval > 0 && elapsed >= g_fileParams.syncinterval)
+        {
+            fdatasync(g_outputFd);
+            lastSync = now;
+        }
+
+        pthread_mutex_lock(&g_sinkLock);
+    }
+    pthread_mutex_unlock(&g_sinkLock);
+
+    return NULL;
+}
+
+static int start_sink_thread(void)
+{
+    g_sinkRunning = 1;
+    if (pthread_create(&g_sinkThread, NULL, &sink_thread, NULL) != 0)
+    {
+        g_sinkRunning = 0;
+        return ERR_LOGGER_CANNOT_START;
+    }
+
+    return 0;
+}
+
+int open_log_file(struct logfileparams* params)
+{
+    struct stat info;
+    int fd = -1;
+
+    pthread_once(&g_loggerOnce, &init_logger);
+    if (g_filePath != NULL || params == NULL || params->path == NULL)
+    {
+        return ERR_LOGGER_CANNOT_OPEN;
+    }
+
+    if ((fd = open(params->path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644)) < 0)
+    {
+        return ERR_LOGGER_CANNOT_OPEN;
+    }
+
+    g_fileParams = *params;
+    g_filePath = strdup(params->path);
+    g_fileParams.path = g_filePath;
+    g_fileOwner = 1;
+    g_fileShared = 0;
+    g_allocated = 0;
+    if (g_fileParams.interval > 0)
+    {
+        g_nextRotation = (time(NULL) / g_fileParams.interval + 1) * g_fileParams.interval;
+    }
+    if (fstat(fd, &info) == 0)
+    {
+        preallocate_log_file(fd, info.st_size);
+    }
+
+    // what is already queued goes to the previous output
+    fflush(stdout);
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    g_outputFd = fd;
+    if (!g_binaryOwnFd)
+    {
+        g_logFd = fd;
+        if (g_binaryEnabled)
+        {
+            write_log_start(fd);
+        }
+    }
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+
+    return start_sink_thread();
+}
+
+void close_log_file(void)
+{
+    int fd = g_outputFd;
+    int started = 0;
+
+    if (g_filePath == NULL)
+    {
+        return;
+    }
+
+    pthread_mutex_lock(&g_sinkLock);
+    started = !__atomic_exchange_n(&g_startSinkThread, 0, __ATOMIC_ACQ_REL);
+    g_sinkRunning = 0;
+    pthread_cond_signal(&g_sinkCond);
+    pthread_mutex_unlock(&g_sinkLock);
+    if (started)
+    {
+        pthread_join(g_sinkThread, NULL);
+    }
+
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    g_outputFd = STDOUT_FILENO;
+    if (!g_binaryOwnFd)
+    {
+        g_logFd = STDOUT_FILENO;
+        if (g_binaryEnabled)
+        {
+            write_log_start(LOG_OUTPUT);
+        }
+    }
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+
+    if (g_previousFd >= 0)
+    {
+        release_log_file(g_previousFd);
+        close(g_previousFd);
+        g_previousFd = -1;
+    }
+    if (g_fileOwner && !g_fileShared)
+    {
+        release_log_file(fd);
+    }
+    fdatasync(fd);
+    close(fd);
+
+    free(g_filePath);
+    g_filePath = NULL;
+}
+
+/* log a message whose arguments are in a va_list */
+static void log_message(LogLevel priority, char* format, va_list args)
+{
+    char fallback[128];
+    char* line = NULL;
+    size_t length = 0;
+
+    if (__atomic_load_n(&g_binaryEnabled, __ATOMIC_ACQUIRE) && (line = thread_line()) != NULL)
+    {
+        size_t size = t_lineSize > UINT16_MAX ? UINT16_MAX : t_lineSize;
+        int written = vsnprintf(line + sizeof(struct logrecord), size - sizeof(struct logrecord),
+                                format, args);
+
+        length = sizeof(struct logrecord);
+        if (written > 0)
+        {
+            length += (size_t)written < size - length ? (size_t)written : size - length - 1;
+        }
+        fill_record((struct logrecord*)line, LOG_RECORD_TEXT, priority, 0, length);
+        emit(line, length);
+        return;
+    }
+
+    // one buffer and one write(2) per line, so a line is never split by
+    // the messages of another thread or process on the same output
+    if ((line = thread_line()) == NULL)
+    {
+        line = fallback;
+    }
+
+    length = format_message(line, line == fallback ? sizeof(fallback) : g_bufferSize,
+                            priority, format, args);
+    emit(line, length);
+}
 
 void logmsg(LogLevel priority, char* format, ...) 
 {
     if (priority <= g_logPriority)
     {
-        time_t timer;
-        struct tm* tm_info;
-        char tsBuffer[26];
-        time(&timer);
-        tm_info = localtime(&timer);
-        strftime(tsBuffer, 26, TIMESTAMP_FORMAT, tm_info);
-    
-        // print the beginning of the log message
-        printf(LOG_MSG_FORMAT_PREFIX, tsBuffer, priority, getpid());
-        
-        // print the actual message from the caller
         va_list args;
         va_start(args, format);
-        printf(format, args);
+        log_message(priority, format, args);
         va_end(args);
-        
-        // end of line
-        printf("\n");
     }
 }
 
+void vlogmsg(LogLevel priority, char* format, va_list args)
+{
+    if (priority <= g_logPriority)
+    {
+        log_message(priority, format, args);
+    }
+}
+
+void set_log_sink(log_sink sink, void* context)
+{
+    pthread_once(&g_loggerOnce, &init_logger);
+    fflush(stdout);
+
+    pthread_mutex_lock(&g_formatLock);
+    pthread_mutex_lock(&g_flushLock);
+    drain_rings();
+    g_sink = sink;
+    g_sinkContext = context;
+    if (g_binaryEnabled)
+    {
+        write_log_start(LOG_OUTPUT);
+    }
+    pthread_mutex_unlock(&g_flushLock);
+    pthread_mutex_unlock(&g_formatLock);
+}
+
+void logbin(uint32_t id, LogLevel priority, ...)
+{
+    struct logformat* def = NULL;
+    char* line = NULL;
+    size_t size = 0;
+    size_t length = sizeof(struct logrecord);
+    va_list args;
+    int i;
+
+    if (priority > g_logPriority || id == 0 || id >= LOG_MAX_FORMATS
+        || (def = __atomic_load_n(&g_formats[id], __ATOMIC_ACQUIRE)) == NULL)
+    {
+        return;
+    }
+
+    va_start(args, priority);
+    if (!__atomic_load_n(&g_binaryEnabled, __ATOMIC_ACQUIRE) || (line = thread_line()) == NULL)
+    {
+        log_message(priority, def->format, args);
+        va_end(args);
+        return;
+    }
+
+    // the raw values are copied, formatting is left to the decoder
+    size = t_lineSize > UINT16_MAX ? UINT16_MAX : t_lineSize;
+    for (i = 0; i < def->argc; i++)
+    {
+        switch (def->types[i])
+        {
+          case LOG_ARG_INT:
+            {
+                int value = va_arg(args, int);
+                memcpy(line + length, &value, sizeof(value));
+                length += sizeof(value);
+            }
+            break;
+          case LOG_ARG_LONG:
+            {
+                long long value = va_arg(args, long long);
+                memcpy(line + length, &value, sizeof(value));
+                length += sizeof(value);
+            }
+            break;
+          case LOG_ARG_DOUBLE:
+            {
+                double value = va_arg(args, double);
+                memcpy(line + length, &value, sizeof(value));
+                length += sizeof(value);
+            }
+            break;
+          case LOG_ARG_LONG_DOUBLE:
+            {
+                long double value = va_arg(args, long double);
+                memcpy(line + length, &value, sizeof(value));
+                length += sizeof(value);
+            }
+            break;
+          case LOG_ARG_POINTER:
+            {
+                uint64_t value = (uintptr_t)va_arg(args, void*);
+                memcpy(line + length, &value, sizeof(value));
+                length += sizeof(value);
+            }
+            break;
+          case LOG_ARG_STRING:
+            {
+                char* value = va_arg(args, char*);
+                // keep room for the arguments after this one
+                long room = (long)size - (long)length - 2 - (def->argc - i - 1) * 18;
+                uint16_t count = 0;
+
+                value = value == NULL ? "(null)" : value;
+                count = room > 0 ? strnlen(value, room) : 0;
+                memcpy(line + length, &count, sizeof(count));
+                memcpy(line + length + sizeof(count), value, count);
+                length += sizeof(count) + count;
+            }
+            break;
+        }
+    }
+    va_end(args);
+
+    fill_record((struct logrecord*)line, LOG_RECORD_MESSAGE, priority, id, length);
+    emit(line, length);
+}
+
+int64_t log_rate_allow(struct lograte* site, uint32_t count, uint32_t interval)
+{
+    struct timespec now;
+    uint64_t start = __atomic_load_n(&site->start, __ATOMIC_RELAXED);
+    uint64_t millis = 0;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    millis = (uint64_t)now.tv_sec * 1000 + now.tv_nsec / 1000000;
+
+    // the thread that moves the interval reports the drops of the last one
+    if (millis - start >= interval
+        && __atomic_compare_exchange_n(&site->start, &start, millis, 0,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+    {
+        __atomic_store_n(&site->count, 1, __ATOMIC_RELAXED);
+        return __atomic_exchange_n(&site->suppressed, 0, __ATOMIC_RELAXED);
+    }
+
+    if (__atomic_fetch_add(&site->count, 1, __ATOMIC_RELAXED) < count)
+    {
+        return 0;
+    }
+
+    __atomic_fetch_add(&site->suppressed, 1, __ATOMIC_RELAXED);
+    return -1;
+}
+
+int log_sample(double probability)
+{
+    uint64_t x = t_sampleState;
+
+    if (x == 0)
+    {
+        x = (uint64_t)(uintptr_t)&t_sampleState ^ ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+        x = x == 0 ? 1 : x;
+    }
+
+    // xorshift64, enough to spread the samples
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    t_sampleState = x;
+
+    return (x >> 11) * (1.0 / 9007199254740992.0) < probability;
+}
+
 void set_buffer_size(uint32_t size)
 {
-    if (size <= 0)
+    if (size == 0)
     {
         g_bufferSize = DEFAULT_BUFFER_SIZE;
     }
+    else if (size < MIN_BUFFER_SIZE)
+    {
+        g_bufferSize = MIN_BUFFER_SIZE;
+    }
     else 
     {
         g_bufferSize = size;
     }
 }
 
+void set_timestamp_precision(int digits)
+{
+    if (digits == LOGGER_PRECISION_SECONDS || digits == LOGGER_PRECISION_MILLIS
+        || digits == LOGGER_PRECISION_MICROS)
+    {
+        g_timestampPrecision = digits;
+    }
+}
+
 void set_priority(LogLevel priority)
 {
     if (priority >= LOGGER_NONE && priority <= LOGGER_VERBOSE) 
@@ -88,7 +1578,7 @@ void set_priority(LogLevel priority)
 
 void print_byte_array(unsigned char *data, size_t len)
 {
-    int i;
+    size_t i;
     for (i = 0; i < len; i++)
     {
         printf("%02X", *data);
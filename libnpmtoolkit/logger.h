@@ -28,6 +28,7 @@
 #ifndef LOGGER_H_
 #define LOGGER_H_
 
+#include <stddef.h>
 #include <stdint.h>
 #include <stdarg.h>
 
@@ -43,6 +44,11 @@
 #define LOGGER_DEBUG    4   // debug info
 #define LOGGER_VERBOSE  5   // more debug info
 
+/* Precision of the timestamp, as the number of digits after the seconds */
+#define LOGGER_PRECISION_SECONDS    0
+#define LOGGER_PRECISION_MILLIS     3
+#define LOGGER_PRECISION_MICROS     6
+
 /* Represent the LogLevel defined on one byte */
 typedef char LogLevel;
 
@@ -52,9 +58,284 @@ extern void set_priority(LogLevel __loglevel);
 /* Set the buffer size to hold one message */
 extern void set_buffer_size(uint32_t __size);
 
+/* Set the precision of the timestamp to one of the LOGGER_PRECISION_*
+   values. The timestamp is only formatted once per second and thread,
+   the milliseconds or microseconds are appended to the cached value */
+extern void set_timestamp_precision(int __digits);
+
 /* Display a log message in stdout */
 extern void logmsg(LogLevel __loglevel, char* __format , ...);
 
+/* Same as logmsg, with the arguments in a va_list */
+extern void vlogmsg(LogLevel __loglevel, char* __format, va_list __args);
+
+/* Sink receiving the output of the logger instead of stdout or the log
+   file: one or more complete lines, or binary records. It is called from
+   the flush thread in asynchronous mode, otherwise from the logging
+   threads, possibly at the same time */
+typedef void (*log_sink)(const char* __data, size_t __length, void* __ctx);
+
+/* Send the output to __sink, or back to stdout or the log file when
+   __sink is NULL. Asynchronous mode, levels and formats are unchanged */
+extern void set_log_sink(log_sink __sink, void* __ctx);
+
+/* Minimal LogLevel displayed, set with set_priority */
+extern LogLevel g_logPriority;
+
+/* Most verbose level kept in the build. Messages of a higher level are
+   removed by the preprocessor with their arguments. Define it before
+   including this header, or define LOGGER_DISABLE to remove them all */
+#ifdef LOGGER_DISABLE
+#undef LOGGER_COMPILE_LEVEL
+#define LOGGER_COMPILE_LEVEL LOGGER_NONE
+#define logmsg(...) ((void)0)
+#endif
+
+#ifndef LOGGER_COMPILE_LEVEL
+#define LOGGER_COMPILE_LEVEL LOGGER_VERBOSE
+#endif
+
+/* Log a message when its level is displayed. The level is compared
+   inline so the arguments are not evaluated for a hidden message */
+#define LOG_AT(level, ...) \
+    do \
+    { \
+        if (__builtin_expect((level) <= g_logPriority, 0)) \
+        { \
+            logmsg((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* Log a message in the binary format when it is enabled, as text
+   otherwise. The format must be a string literal, it is registered the
+   first time the call site is reached */
+#define LOGB(level, format, ...) \
+    do \
+    { \
+        static uint32_t __logFormatId = 0; \
+        if ((level) <= LOGGER_COMPILE_LEVEL && __builtin_expect((level) <= g_logPriority, 0)) \
+        { \
+            uint32_t __id = __atomic_load_n(&__logFormatId, __ATOMIC_RELAXED); \
+            if (__id == 0) \
+            { \
+                __id = register_log_format(format); \
+                __id = __id == 0 ? LOG_FORMAT_TEXT : __id; \
+                __atomic_store_n(&__logFormatId, __id, __ATOMIC_RELAXED); \
+            } \
+            if (__id != LOG_FORMAT_TEXT) \
+            { \
+                logbin(__id, (level), ##__VA_ARGS__); \
+            } \
+            else \
+            { \
+                logmsg((level), format, ##__VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+/* Log at most count messages every interval ms from this call site. The
+   first message of an interval following drops is preceded by the number
+   of messages dropped, so a failure repeated on every request only costs
+   an atomic increment once the limit is reached */
+#define LOG_RATE_LIMITED(level, count, interval, ...) \
+    do \
+    { \
+        static struct lograte __logRate = { 0, 0, 0 }; \
+        if ((level) <= LOGGER_COMPILE_LEVEL && __builtin_expect((level) <= g_logPriority, 0)) \
+        { \
+            int64_t __dropped = log_rate_allow(&__logRate, (count), (interval)); \
+            if (__dropped > 0) \
+            { \
+                logmsg((level), "%lld messages dropped at %s:%d", \
+                       (long long)__dropped, __FILE__, __LINE__); \
+            } \
+            if (__dropped >= 0) \
+            { \
+                logmsg((level), __VA_ARGS__); \
+            } \
+        } \
+    } while (0)
+
+/* Log one message out of every n from this call site */
+#define LOG_EVERY_N(level, n, ...) \
+    do \
+    { \
+        static uint32_t __logCount = 0; \
+        if ((level) <= LOGGER_COMPILE_LEVEL && __builtin_expect((level) <= g_logPriority, 0) \
+            && __atomic_fetch_add(&__logCount, 1, __ATOMIC_RELAXED) % (n) == 0) \
+        { \
+            logmsg((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+/* Log a message with the given probability, between 0 and 1 */
+#define LOG_SAMPLED(level, probability, ...) \
+    do \
+    { \
+        if ((level) <= LOGGER_COMPILE_LEVEL && __builtin_expect((level) <= g_logPriority, 0) \
+            && log_sample(probability)) \
+        { \
+            logmsg((level), __VA_ARGS__); \
+        } \
+    } while (0)
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_FATAL
+#define LOG_FATAL(...)      LOG_AT(LOGGER_FATAL, __VA_ARGS__)
+#else
+#define LOG_FATAL(...)      ((void)0)
+#endif
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_ERROR
+#define LOG_ERROR(...)      LOG_AT(LOGGER_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)      ((void)0)
+#endif
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_WARNING
+#define LOG_WARNING(...)    LOG_AT(LOGGER_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...)    ((void)0)
+#endif
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_INFO
+#define LOG_INFO(...)       LOG_AT(LOGGER_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)       ((void)0)
+#endif
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_DEBUG
+#define LOG_DEBUG(...)      LOG_AT(LOGGER_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)      ((void)0)
+#endif
+
+#if LOGGER_COMPILE_LEVEL >= LOGGER_VERBOSE
+#define LOG_VERBOSE(...)    LOG_AT(LOGGER_VERBOSE, __VA_ARGS__)
+#else
+#define LOG_VERBOSE(...)    ((void)0)
+#endif
+
+/* Behaviour of an asynchronous logger when the buffer of a thread is full */
+#define LOGGER_FULL_BLOCK   0   // sleep until the flush thread makes room
+#define LOGGER_FULL_DROP    1   // drop the message and count it
+#define LOGGER_FULL_SYNC    2   // write the message from the caller's thread
+
+/* Default size in bytes of the buffer allocated for each logging thread */
+#define DEFAULT_RING_SIZE   65536
+
+/* Switch to asynchronous logging. Each thread formats its messages in its
+   own buffer of __ringSize bytes (rounded up to a power of 2) and a
+   background thread writes them in batches. What is still queued is
+   written when the process exits. A forked child starts its own flush
+   thread with its first message. __policy is one of the LOGGER_FULL_*
+   values. Return 0 on success, otherwise negative int */
+extern int enable_async_logging(uint32_t __ringSize, int __policy);
+
+/* Write every pending message, stop the flush thread and go back to
+   synchronous logging */
+extern void disable_async_logging(void);
+
+/* Wait until every message logged before the call has been written */
+extern void flush_log(void);
+
+/* Number of messages dropped because a buffer was full */
+extern uint64_t dropped_log_messages(void);
+
+/* Log file and its rotation policy */
+struct logfileparams
+  {
+    char* path;
+    uint64_t maxsize;       // rotate when the file reaches this size, 0 for no limit
+    uint32_t interval;      // rotate every interval seconds, 0 for never
+    uint32_t syncinterval;  // fdatasync every syncinterval ms, 0 to leave it to the kernel
+    uint64_t prealloc;      // disk space reserved ahead of the writes, 0 for none
+  };
+
+/* Write the log to a file instead of stdout. The file is opened in append
+   mode and a background thread reserves its space with fallocate, syncs
+   it and rotates it: the current file is renamed with a timestamp suffix
+   and a new one takes its descriptor, so writers never wait. A forked
+   process follows the rotations of its parent from its first message.
+   Return 0 on success,
+   otherwise negative int */
+extern int open_log_file(struct logfileparams* __params);
+
+/* Write what is pending, close the log file and go back to stdout */
+extern void close_log_file(void);
+
+/* Binary log. The log is a sequence of records starting with a struct
+   logrecord, integers are in the byte order of the host */
+#define LOG_BINARY_MAGIC    "NPMLOGB1"
+#define LOG_RECORD_START    1   // start of a log, followed by LOG_BINARY_MAGIC
+#define LOG_RECORD_FORMAT   2   // argument count, argument types and format of id
+#define LOG_RECORD_MESSAGE  3   // raw arguments of a message using format id
+#define LOG_RECORD_TEXT     4   // message formatted by logmsg, without end of line
+#define LOG_RECORD_FORK     5   // pid is a child of the process id, sharing its formats
+
+/* Type of an argument in a binary message */
+#define LOG_ARG_INT         1   // int
+#define LOG_ARG_LONG        2   // long long
+#define LOG_ARG_DOUBLE      3   // double
+#define LOG_ARG_LONG_DOUBLE 4   // long double
+#define LOG_ARG_STRING      5   // length on 2 bytes followed by the characters
+#define LOG_ARG_POINTER     6   // pointer on 8 bytes
+
+/* Most arguments in a format used for binary logging */
+#define LOG_MAX_ARGS        32
+
+/* Format id of a call site that logs as text */
+#define LOG_FORMAT_TEXT     0xFFFFFFFF
+
+/* Header of a binary record */
+struct logrecord
+  {
+    uint16_t length;        // length of the record, header included
+    uint8_t type;           // one of the LOG_RECORD_* values
+    int8_t level;
+    uint32_t id;            // format id, or parent pid of a fork
+    uint64_t timestamp;     // nanoseconds since the epoch
+    uint32_t pid;
+    uint32_t reserved;
+  };
+
+/* Write the log in the binary format to __fd, or to the current output
+   (stdout or the log file) when __fd is negative. Messages logged with
+   LOGB only store their format id and raw arguments, the text is rebuilt
+   offline by the logdecode tool. Return 0 on success, otherwise negative int */
+extern int enable_binary_logging(int __fd);
+
+/* Go back to text messages on the current output. __fd is not closed */
+extern void disable_binary_logging(void);
+
+/* Store in __types, of LOG_MAX_ARGS entries, the LOG_ARG_* type of each
+   argument of __format. Return the number of arguments, or -1 if one of
+   them cannot be stored in a record, %n and %m included */
+extern int parse_log_format(const char* __format, uint8_t* __types);
+
+/* Register a format for binary logging and write its definition to the
+   log. Return its id, 0 if the format cannot be stored */
+extern uint32_t register_log_format(char* __format);
+
+/* Log the arguments of a message using a registered format */
+extern void logbin(uint32_t __id, LogLevel __loglevel, ...);
+
+/* State of a rate limited call site, updated without lock */
+struct lograte
+  {
+    uint64_t start;         // start of the current interval, in ms
+    uint32_t count;         // messages logged during the interval
+    uint32_t suppressed;    // messages dropped since the interval started
+  };
+
+/* Count one message of a call site allowed __count messages every
+   __interval ms. Return -1 if the message must be dropped, otherwise the
+   number of messages dropped during the previous interval */
+extern int64_t log_rate_allow(struct lograte* __site, uint32_t __count, uint32_t __interval);
+
+/* Return 1 with the probability __probability, from a generator owned by
+   the calling thread */
+extern int log_sample(double __probability);
+
 /* Display a byte array in the standard output */
 extern void print_byte_array(unsigned char *data, size_t len);
 